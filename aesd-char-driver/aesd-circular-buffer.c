@@ -10,12 +10,25 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/errno.h>
 #else
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
 #endif
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * @return nonzero when @param rel, relative to the oldest entry, falls inside the entry in @param slot
+ */
+static inline bool entry_holds(const struct aesd_circular_buffer *buffer, uint32_t slot, size_t base, size_t rel)
+{
+    return rel - (buffer->start[slot] - base) < buffer->entry[slot].size;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -25,6 +38,8 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ * Sequential reads find their entry at the cursor left by the previous lookup or right after it, other
+ * positions are binary searched in the entry start offsets.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
@@ -33,49 +48,63 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
         return NULL;
     }
 
-    struct aesd_buffer_entry *curr_entry;
-    struct aesd_buffer_entry *ret;
-    bool found = false;
-    uint8_t curr_index = buffer->out_offs;
-    size_t curr_offset = 0;
+    uint32_t lo, hi, mid, slot;
+    size_t base;
 
-    do {
-        curr_entry = &buffer->entry[curr_index];
-
-        size_t entry_size = curr_entry->size;
+    if (buffer->count == 0 || char_offset >= aesd_circular_buffer_bytes(buffer)) {
+        return NULL;
+    }
+    base = buffer->start[buffer->out_offs];
 
-        if (char_offset >= curr_offset && char_offset < curr_offset + entry_size) {
-            *entry_offset_byte_rtn = char_offset - curr_offset;
-            ret = curr_entry;
-            found = true;
-            break;
+    slot = buffer->cursor;
+    if (((slot - buffer->out_offs) & buffer->mask) >= buffer->count || !entry_holds(buffer, slot, base, char_offset)) {
+        slot = (slot + 1) & buffer->mask;
+        if (((slot - buffer->out_offs) & buffer->mask) >= buffer->count ||
+            !entry_holds(buffer, slot, base, char_offset)) {
+            // Last entry starting at or before char_offset, empty entries before it share its start
+            lo = 0;
+            hi = buffer->count - 1;
+            while (lo < hi) {
+                mid = lo + (hi - lo + 1) / 2;
+                if (buffer->start[(buffer->out_offs + mid) & buffer->mask] - base <= char_offset) {
+                    lo = mid;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+            slot = (buffer->out_offs + lo) & buffer->mask;
         }
+    }
 
-        curr_offset += entry_size;
-        curr_index = (curr_index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    } while (curr_index != buffer->in_offs);
-
-    return found ? ret : NULL;
+    buffer->cursor = slot;
+    *entry_offset_byte_rtn = char_offset - (buffer->start[slot] - base);
+    return &buffer->entry[slot];
 }
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
 * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
+* new start location. The caller frees the overwritten entry first when it owns its memory, it is the
+* one at buffer->out_offs while buffer->full is set.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
 */
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
-{   
+{
+    // With more slots than entries kept the oldest entry isn't in the slot written next
+    if (buffer->full) {
+        buffer->entry[buffer->out_offs].buffptr = NULL;
+        buffer->entry[buffer->out_offs].size = 0;
+        buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+    } else {
+        buffer->count++;
+    }
 
     buffer->entry[buffer->in_offs] = *add_entry;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    
-    if(!buffer->full && buffer->in_offs == buffer->out_offs){
-        buffer->full = true; 
-    } else{
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
+    buffer->start[buffer->in_offs] = buffer->end;
+    buffer->end += add_entry->size;
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->mask;
+    buffer->full = buffer->count == buffer->size;
 }
 
 /**
@@ -84,4 +113,64 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->inline_entry;
+    buffer->start = buffer->inline_start;
+    buffer->size = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->mask = AESDCHAR_INLINE_ENTRIES - 1;
+}
+
+/**
+* Initializes @param buffer to an empty struct keeping the last @param size entries, allocating the
+* slots when they don't fit inline. The slot count is @param size rounded up to a power of two.
+* @return 0 on success, -EINVAL for a size of 0 or above AESDCHAR_MAX_RING_SIZE, -ENOMEM when the
+* slots can't be allocated
+*/
+int aesd_circular_buffer_alloc(struct aesd_circular_buffer *buffer, size_t size)
+{
+    size_t slots = 1;
+
+    if (size == 0 || size > AESDCHAR_MAX_RING_SIZE) {
+        return -EINVAL;
+    }
+    while (slots < size) {
+        slots <<= 1;
+    }
+
+    aesd_circular_buffer_init(buffer);
+    if (slots > AESDCHAR_INLINE_ENTRIES) {
+#ifdef __KERNEL__
+        // Big rings span many pages, kvcalloc() falls back to vmalloc when they aren't contiguous
+        buffer->entry = kvcalloc(slots, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+        buffer->start = kvcalloc(slots, sizeof(size_t), GFP_KERNEL);
+#else
+        buffer->entry = calloc(slots, sizeof(struct aesd_buffer_entry));
+        buffer->start = calloc(slots, sizeof(size_t));
+#endif
+        if (!buffer->entry || !buffer->start) {
+            aesd_circular_buffer_free(buffer);
+            return -ENOMEM;
+        }
+        buffer->mask = slots - 1;
+    }
+    buffer->size = size;
+
+    return 0;
+}
+
+/**
+* Releases the slots allocated by aesd_circular_buffer_alloc(), not the memory the entries point to.
+* @param buffer is left empty with the default size.
+*/
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
+{
+    if (buffer->entry != buffer->inline_entry) {
+#ifdef __KERNEL__
+        kvfree(buffer->entry);
+        kvfree(buffer->start);
+#else
+        free(buffer->entry);
+        free(buffer->start);
+#endif
+    }
+    aesd_circular_buffer_init(buffer);
 }
@@ -16,7 +16,19 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default number of writes kept, the ring_size module parameter overrides it
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Slots held inside struct aesd_circular_buffer, the smallest power of two
+ * fitting the default. Bigger rings are allocated by aesd_circular_buffer_alloc()
+ */
+#define AESDCHAR_INLINE_ENTRIES 16
+/**
+ * Largest ring aesd_circular_buffer_alloc() accepts
+ */
+#define AESDCHAR_MAX_RING_SIZE (1u << 20)
 
 struct aesd_buffer_entry
 {
@@ -33,22 +45,52 @@ struct aesd_buffer_entry
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations.
+     * Has mask + 1 slots, either inline_entry or allocated by aesd_circular_buffer_alloc()
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Running byte offset where the entry in each slot starts, counting every byte ever
+     * added so eviction doesn't shift the others. Lookups compare offsets relative to
+     * the oldest entry, so the count wrapping around is harmless
+     */
+    size_t *start;
+    /**
+     * Running byte offset where the next entry starts
+     */
+    size_t end;
+    /**
+     * Slot of the entry the last lookup returned, sequential reads hit it or the next one
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t cursor;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
+    /**
+     * Number of entries stored
+     */
+    uint32_t count;
+    /**
+     * Number of entries kept before the oldest one is overwritten
+     */
+    uint32_t size;
+    /**
+     * Number of slots minus one. The slot count is a power of two so stepping
+     * through the ring is a mask rather than a modulo
+     */
+    uint32_t mask;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    struct aesd_buffer_entry inline_entry[AESDCHAR_INLINE_ENTRIES];
+    size_t inline_start[AESDCHAR_INLINE_ENTRIES];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -58,14 +100,26 @@ extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_alloc(struct aesd_circular_buffer *buffer, size_t size);
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
+
+/**
+ * @return bytes held by the entries of @param buffer
+ */
+static inline size_t aesd_circular_buffer_bytes(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->count ? buffer->end - buffer->start[buffer->out_offs] : 0;
+}
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +128,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
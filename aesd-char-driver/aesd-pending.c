@@ -0,0 +1,78 @@
+/**
+ * @file aesd-pending.c
+ * @brief Accumulation of a record arriving in partial writes
+ *
+ * Builds in user space too so the growth policy can be measured there.
+ */
+
+#ifdef __KERNEL__
+#include <linux/slab.h>
+#else
+#include <stdlib.h>
+#define krealloc(ptr, size, flags) realloc(ptr, size)
+#define kfree(ptr) free(ptr)
+#endif
+
+#include "aesd-pending.h"
+
+/**
+* Makes room for @param count more bytes at the end of @param pending. The first write of a
+* record is allocated at its exact size, since most records arrive in one write, later ones
+* at least double the allocation.
+* Any necessary locking must be handled by the caller
+* @return where the next @param count bytes go, or NULL when the allocation fails. The bytes
+* already stored are kept either way.
+*/
+char *aesd_pending_reserve(struct aesd_pending *pending, size_t count)
+{
+    size_t need = pending->size + count;
+    size_t cap;
+    char *buf;
+
+    if (need < count) {
+        return NULL;
+    }
+
+    if (need > pending->cap) {
+        cap = pending->cap ? pending->cap * 2 : need;
+        if (cap < need) {
+            cap = need;
+        }
+
+        buf = krealloc(pending->buf, cap, GFP_KERNEL);
+        if (!buf) {
+            return NULL;
+        }
+        pending->buf = buf;
+        pending->cap = cap;
+    }
+
+    return pending->buf + pending->size;
+}
+
+/**
+* Hands the record accumulated in @param pending over to the caller, who frees it with kfree(),
+* and leaves @param pending empty.
+* @param size set to the number of bytes in the record
+*/
+char *aesd_pending_take(struct aesd_pending *pending, size_t *size)
+{
+    char *buf = pending->buf;
+
+    *size = pending->size;
+    pending->buf = NULL;
+    pending->size = 0;
+    pending->cap = 0;
+    return buf;
+}
+
+/**
+* Drops a record left without its newline.
+*/
+void aesd_pending_free(struct aesd_pending *pending)
+{
+    kfree(pending->buf);
+    pending->buf = NULL;
+    pending->size = 0;
+    pending->cap = 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * aesd-pending.h
+ *
+ * A record being accumulated from partial writes until its newline arrives.
+ */
+
+#ifndef AESD_PENDING_H
+#define AESD_PENDING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // size_t
+#endif
+
+struct aesd_pending
+{
+    /**
+     * Bytes written so far, NULL until the first partial write
+     */
+    char *buf;
+    /**
+     * Number of bytes stored in buf
+     */
+    size_t size;
+    /**
+     * Number of bytes allocated for buf. Grows geometrically so a record
+     * arriving in many small writes is copied O(log n) times, not once per write
+     */
+    size_t cap;
+};
+
+extern char *aesd_pending_reserve(struct aesd_pending *pending, size_t count);
+
+extern char *aesd_pending_take(struct aesd_pending *pending, size_t *size);
+
+extern void aesd_pending_free(struct aesd_pending *pending);
+
+#endif /* AESD_PENDING_H */
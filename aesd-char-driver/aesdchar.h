@@ -9,6 +9,7 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd-pending.h"
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
@@ -29,9 +30,7 @@ struct aesd_dev
 {
     struct cdev cdev;     /* Char device structure      */
     struct aesd_circular_buffer cb;
-    size_t cb_size;
-    char* buf;
-    size_t buf_size;
+    struct aesd_pending pending; /* record still waiting for its newline */
     struct mutex lock;
 };
 
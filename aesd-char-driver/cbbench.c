@@ -0,0 +1,175 @@
+/*
+ * Userspace benchmark of aesd_circular_buffer_find_entry_offset_for_fpos().
+ *
+ * Builds aesd-circular-buffer.c the way the unit tests do and replays a full
+ * ring the way aesd_read() does, one lookup per entry, plus lookups at random
+ * positions. "linear" is the walk from out_offs summing entry sizes that the
+ * lookup did before it kept start offsets.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include "aesd-circular-buffer.h"
+
+#define DEFAULT_RECORD_SIZE 32
+#define DEFAULT_DURATION    0.5
+#define RANDOM_LOOKUPS      4096
+
+static const size_t default_rings[] = { 10, 100, 1000, 10000, 100000 };
+
+typedef struct aesd_buffer_entry *(*lookup_fn)(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                               size_t *entry_offset_byte_rtn);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct aesd_buffer_entry *linear_lookup(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                               size_t *entry_offset_byte_rtn) {
+    uint32_t index = buffer->out_offs;
+    size_t offset = 0;
+    uint32_t i;
+
+    for (i = 0; i < buffer->count; i++) {
+        if (char_offset < offset + buffer->entry[index].size) {
+            *entry_offset_byte_rtn = char_offset - offset;
+            return &buffer->entry[index];
+        }
+        offset += buffer->entry[index].size;
+        index = (index + 1) & buffer->mask;
+    }
+    return NULL;
+}
+
+/**
+ * Reads the whole ring from position 0, one entry per lookup like aesd_read().
+ * @return lookups done
+ */
+static size_t replay(struct aesd_circular_buffer *buffer, lookup_fn lookup) {
+    struct aesd_buffer_entry *entry;
+    size_t pos = 0, offset, lookups = 0;
+
+    while ((entry = lookup(buffer, pos, &offset)) != NULL) {
+        pos += entry->size - offset;
+        lookups++;
+    }
+    return lookups;
+}
+
+static size_t seek_random(struct aesd_circular_buffer *buffer, lookup_fn lookup, const size_t *positions) {
+    size_t offset, i;
+
+    for (i = 0; i < RANDOM_LOOKUPS; i++) {
+        if (!lookup(buffer, positions[i], &offset)) {
+            return 0;
+        }
+    }
+    return RANDOM_LOOKUPS;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d seconds per case] [-s record size] [-r ring size, repeatable]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    static const char *impl_names[] = { "linear", "indexed" };
+    static const char *mode_names[] = { "replay", "random" };
+    lookup_fn impls[] = { linear_lookup, aesd_circular_buffer_find_entry_offset_for_fpos };
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    size_t record_size = DEFAULT_RECORD_SIZE;
+    double duration = DEFAULT_DURATION;
+    size_t rings[32];
+    size_t nrings = 0;
+    size_t positions[RANDOM_LOOKUPS];
+    size_t lookups, expected, i, r, k, m;
+    uint64_t start, elapsed, total;
+    char *record;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:r:")) != -1) {
+        switch (opt) {
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 's':
+                record_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                if (nrings == sizeof(rings) / sizeof(rings[0])) {
+                    usage(argv[0]);
+                }
+                rings[nrings++] = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (nrings == 0) {
+        nrings = sizeof(default_rings) / sizeof(default_rings[0]);
+        memcpy(rings, default_rings, sizeof(default_rings));
+    }
+    if (record_size == 0 || duration <= 0) {
+        usage(argv[0]);
+    }
+
+    record = malloc(record_size);
+    if (!record) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    memset(record, 'a', record_size);
+    record[record_size - 1] = '\n';
+
+    printf("%zu byte records, %.2f s per case\n", record_size, duration);
+    printf("%-8s %-7s %-8s %14s %12s\n", "ring", "mode", "impl", "lookups/s", "ns/lookup");
+
+    for (r = 0; r < nrings; r++) {
+        if (aesd_circular_buffer_alloc(&buffer, rings[r]) != 0) {
+            fprintf(stderr, "couldnt allocate a ring of %zu entries\n", rings[r]);
+            continue;
+        }
+        // Wrap the ring once so out_offs isn't slot 0
+        entry.buffptr = record;
+        entry.size = record_size;
+        for (i = 0; i < rings[r] + rings[r] / 2; i++) {
+            aesd_circular_buffer_add_entry(&buffer, &entry);
+        }
+        for (i = 0; i < RANDOM_LOOKUPS; i++) {
+            positions[i] = (size_t)rand() % aesd_circular_buffer_bytes(&buffer);
+        }
+
+        for (m = 0; m < sizeof(mode_names) / sizeof(mode_names[0]); m++) {
+            expected = m == 0 ? rings[r] : RANDOM_LOOKUPS;
+
+            for (k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+                total = 0;
+                start = now_ns();
+                do {
+                    lookups = m == 0 ? replay(&buffer, impls[k]) : seek_random(&buffer, impls[k], positions);
+                    if (lookups != expected) {
+                        fprintf(stderr, "%s did %zu lookups, expected %zu\n", impl_names[k], lookups, expected);
+                        return EXIT_FAILURE;
+                    }
+                    total += lookups;
+                    elapsed = now_ns() - start;
+                } while (elapsed < duration * 1e9);
+
+                printf("%-8zu %-7s %-8s %14.0f %12.2f\n", rings[r], mode_names[m], impl_names[k],
+                       (double)total / elapsed * 1e9, (double)elapsed / total);
+            }
+        }
+        aesd_circular_buffer_free(&buffer);
+    }
+
+    free(record);
+    return EXIT_SUCCESS;
+}
@@ -22,6 +22,10 @@
 #include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+unsigned int ring_size = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+module_param(ring_size, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_size, "Number of writes kept before the oldest is dropped");
 
 MODULE_AUTHOR("Jorge Catarino");
 MODULE_LICENSE("Dual BSD/GPL");
@@ -47,6 +51,10 @@ int aesd_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
+/**
+ * Copies entries from @param f_pos on until @param count bytes were read or
+ * the ring is exhausted, so a replay of the whole history takes one call.
+ */
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
@@ -62,41 +70,65 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
         return -ERESTARTSYS;
     }
 
-    cmd_entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->cb, *f_pos, &cmd_offset);
+    while ((size_t)retval < count) {
+        cmd_entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->cb, *f_pos, &cmd_offset);
 
-    if (!cmd_entry) {
-        PDEBUG("No data to read");
-        retval = 0; 
-        goto unlock_out;
-    }
+        if (!cmd_entry) {
+            PDEBUG("No more data to read");
+            break;
+        }
 
-    chars_read = min(cmd_entry->size - cmd_offset, count);
+        chars_read = min(cmd_entry->size - cmd_offset, count - retval);
 
-    if (chars_read <= 0) {
-        retval = 0; 
-        goto unlock_out;
-    }
+        // Report what was copied before the fault, the fault itself only when nothing was
+        if (copy_to_user(buf + retval, &(cmd_entry->buffptr[cmd_offset]), chars_read)) {
+            if (retval == 0) {
+                retval = -EFAULT;
+            }
+            break;
+        }
 
-    if (copy_to_user(buf, &(cmd_entry->buffptr[cmd_offset]), chars_read)) {
-        retval = -EFAULT; 
-        goto unlock_out;
+        *f_pos += chars_read;
+        retval += chars_read;
     }
 
-    *f_pos += chars_read;
-    retval = chars_read; 
-
-unlock_out:
     mutex_unlock(&dev->lock);  
     PDEBUG("read retval %ld", retval);
     return retval;
 }
 
+/**
+ * Stores a complete record in the ring, freeing the oldest one when it is full.
+ */
+static void aesd_add_record(struct aesd_dev *dev, const char *buffptr, size_t size)
+{
+    struct aesd_buffer_entry new;
+
+    if (dev->cb.full) {
+        uint32_t curr_offset = dev->cb.out_offs;
+        if (dev->cb.entry[curr_offset].buffptr != NULL) {
+            kfree(dev->cb.entry[curr_offset].buffptr);
+            dev->cb.entry[curr_offset].size = 0;
+        }
+    }
+
+    new.buffptr = buffptr;
+    new.size = size;
+
+    aesd_circular_buffer_add_entry(&dev->cb, &new);
+}
+
+/**
+ * Stores one ring entry per newline terminated command in the written data,
+ * the first one completing the pending partial record. Whatever follows the
+ * last newline stays pending.
+ */
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-    struct aesd_buffer_entry new;
-    char *newline;
+    char *newline, *tail, *record;
     size_t char_to_write = 0;
+    size_t pending_size, start = 0, end;
     ssize_t retval = -ENOMEM;
     
     struct aesd_dev *dev = filp->private_data;
@@ -104,68 +136,68 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
 
+    // Nothing to buffer, and reserving nothing on an empty buffer allocates nothing
+    if (count == 0) {
+        return 0;
+    }
+
     if (mutex_lock_interruptible(&dev->lock)) {
         return -ERESTARTSYS;
     }
 
-    if(!dev->buf){
-        dev->buf = kmalloc(count, GFP_KERNEL);
-
-        if (!dev->buf) {
-            retval = -ENOMEM;
-            goto unlock_out;
-        }
-
-        memset(dev->buf, 0, count);
+    pending_size = dev->pending.size;
+    tail = aesd_pending_reserve(&dev->pending, count);
 
-        char_to_write = copy_from_user(dev->buf, buf, count);
-
-        retval = count - char_to_write;
-        dev->buf_size = retval;
+    if (!tail) {
+        retval = -ENOMEM;
+        goto unlock_out;
     }
-    else{
-        char* extend_buf = (char*) krealloc(dev->buf, dev->buf_size + count, GFP_KERNEL);
 
-        if (!extend_buf) {
-            retval = -ENOMEM;
-            goto unlock_out;
-        }
+    char_to_write = copy_from_user(tail, buf, count);
 
-        dev->buf = extend_buf;
+    retval = count - char_to_write;
+    dev->pending.size += retval;
 
-        memset(&dev->buf[dev->buf_size], 0, count);
+    // Earlier partial writes had no newline, only the new bytes need scanning
+    newline = memchr(tail, '\n', retval);
 
-        char_to_write = copy_from_user(dev->buf + dev->buf_size, buf, count);
-
-        retval = count - char_to_write;
-        dev->buf_size += retval;
-    }
+    while (newline) {
+        end = newline - dev->pending.buf + 1;
 
-    newline = memchr(dev->buf, '\n', dev->buf_size);
-
-    if(newline){
+        // A write ending on its only newline is the whole pending record, hand it over without copying
+        if (start == 0 && end == dev->pending.size) {
+            record = aesd_pending_take(&dev->pending, &end);
+            aesd_add_record(dev, record, end);
+            break;
+        }
 
-        if (dev->cb.full) {
-            uint8_t curr_offset = dev->cb.in_offs;
-            if (dev->cb.entry[curr_offset].buffptr != NULL) {
-                kfree(dev->cb.entry[curr_offset].buffptr);
-                dev->cb.entry[curr_offset].size = 0;
+        record = kmalloc(end - start, GFP_KERNEL);
+        if (!record) {
+            // Keep the records stored so far and report a short write ending with the last one
+            if (start == 0) {
+                dev->pending.size = pending_size;
+                retval = -ENOMEM;
+            } else {
+                dev->pending.size = 0;
+                retval = start - pending_size;
             }
+            goto unlock_out;
         }
+        memcpy(record, dev->pending.buf + start, end - start);
+        aesd_add_record(dev, record, end - start);
 
-        new.buffptr = dev->buf;
-        new.size = dev->buf_size;
-        
-        aesd_circular_buffer_add_entry(&dev->cb, &new);
-
-        dev->buf = NULL;
-        dev->buf_size = 0;
+        start = end;
+        newline = memchr(dev->pending.buf + start, '\n', dev->pending.size - start);
     }
-    else {
-        PDEBUG("partial write %s with %zu bytes", dev->buf, dev->buf_size);
+
+    if (start > 0 && dev->pending.buf) {
+        memmove(dev->pending.buf, dev->pending.buf + start, dev->pending.size - start);
+        dev->pending.size -= start;
     }
 
-    dev->cb_size += retval;
+    if (dev->pending.size) {
+        PDEBUG("partial write with %zu bytes", dev->pending.size);
+    }
 
 unlock_out:
     mutex_unlock(&dev->lock);
@@ -181,9 +213,9 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence){
         return -ERESTARTSYS;
     }
 
-    retval = fixed_size_llseek(filp, off, whence, dev->cb_size);
+    retval = fixed_size_llseek(filp, off, whence, aesd_circular_buffer_bytes(&dev->cb));
 
-    if (retval < 0 || retval > dev->cb_size) {
+    if (retval < 0 || retval > aesd_circular_buffer_bytes(&dev->cb)) {
         retval = -EINVAL;
         goto unlock_out;
     }
@@ -202,22 +234,25 @@ long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned
     struct aesd_dev *dev = filp->private_data;
     struct aesd_buffer_entry *tmp;
     
-    int i;
+    unsigned int i;
+    uint32_t index;
     loff_t off = 0;
     long retval = 0;
 
     PDEBUG("write_cmd %u write_cmd_offset %u", write_cmd, write_cmd_offset);
 
-    if (write_cmd < 0 || write_cmd > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
-        return -EINVAL;
-    }
-
     if (mutex_lock_interruptible(&dev->lock)) {
         return -ERESTARTSYS;
     }
 
-    for (i = 0; i < write_cmd; i++) {
-        tmp = &dev->cb.entry[i];
+    if (write_cmd >= dev->cb.count) {
+        retval = -EINVAL;
+        goto unlock_out;
+    }
+
+    index = dev->cb.out_offs;
+    for (i = 0; i < write_cmd; i++, index = (index + 1) & dev->cb.mask) {
+        tmp = &dev->cb.entry[index];
         if (tmp->buffptr != NULL && tmp->size > 0) {
             off += tmp->size;
         } 
@@ -229,7 +264,7 @@ long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned
 
     PDEBUG("After looping off %lld", off);
 
-    tmp = &dev->cb.entry[write_cmd];
+    tmp = &dev->cb.entry[index];
     if ((tmp->buffptr != NULL && tmp->size > 0) && (write_cmd_offset <= tmp->size)) {
         off += write_cmd_offset;
         PDEBUG("if valid off %lld", off);
@@ -308,16 +343,19 @@ int aesd_init_module(void)
     }
     memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    aesd_circular_buffer_init(&aesd_device.cb);
-    aesd_device.buf = NULL;
-    aesd_device.buf_size = 0;
-    aesd_device.cb_size = 0;
+    result = aesd_circular_buffer_alloc(&aesd_device.cb, ring_size);
+    if (result) {
+        printk(KERN_WARNING "Can't allocate a ring of %u writes\n", ring_size);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
 
     mutex_init(&aesd_device.lock);
 
     result = aesd_setup_cdev(&aesd_device);
 
     if( result ) {
+        aesd_circular_buffer_free(&aesd_device.cb);
         unregister_chrdev_region(dev, 1);
     }
     return result;
@@ -328,7 +366,7 @@ void aesd_cleanup_module(void)
 {
     struct aesd_buffer_entry *tmp;
     struct aesd_circular_buffer *buffer = &aesd_device.cb;
-    uint8_t index;
+    uint32_t index;
     
     dev_t devno = MKDEV(aesd_major, aesd_minor);
     
@@ -341,6 +379,8 @@ void aesd_cleanup_module(void)
             tmp->size = 0;
         }
     }
+    aesd_circular_buffer_free(buffer);
+    aesd_pending_free(&aesd_device.pending);
     mutex_destroy(&aesd_device.lock);
 
     unregister_chrdev_region(devno, 1);
@@ -0,0 +1,151 @@
+/*
+ * Userspace benchmark of a record arriving in many small writes.
+ *
+ * Feeds one record to aesd_pending_reserve() a write at a time, the way
+ * aesd_write() accumulates partial writes, and hands it over once complete.
+ * "realloc" is what aesd_write() did before: grow the buffer to the exact new
+ * size and zero the extension on every write.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include "aesd-pending.h"
+
+#define DEFAULT_RECORD_SIZE (256 * 1024)
+#define DEFAULT_DURATION    0.5
+
+static const size_t default_writes[] = { 1, 16, 128, 1024 };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static char *accumulate_realloc(const char *data, size_t record_size, size_t write_size) {
+    char *buf = NULL, *grown;
+    size_t size = 0, count;
+
+    while (size < record_size) {
+        count = record_size - size < write_size ? record_size - size : write_size;
+        grown = realloc(buf, size + count);
+        if (!grown) {
+            free(buf);
+            return NULL;
+        }
+        buf = grown;
+        memset(buf + size, 0, count);
+        memcpy(buf + size, data + size, count);
+        size += count;
+    }
+    return buf;
+}
+
+static char *accumulate_pending(const char *data, size_t record_size, size_t write_size) {
+    struct aesd_pending pending = { NULL, 0, 0 };
+    size_t count;
+    char *tail;
+
+    while (pending.size < record_size) {
+        count = record_size - pending.size < write_size ? record_size - pending.size : write_size;
+        tail = aesd_pending_reserve(&pending, count);
+        if (!tail) {
+            aesd_pending_free(&pending);
+            return NULL;
+        }
+        memcpy(tail, data + pending.size, count);
+        pending.size += count;
+    }
+    return aesd_pending_take(&pending, &count);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d seconds per case] [-r record size] [-w write size, repeatable]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    static const char *impl_names[] = { "realloc", "pending" };
+    char *(*impls[])(const char *, size_t, size_t) = { accumulate_realloc, accumulate_pending };
+    size_t record_size = DEFAULT_RECORD_SIZE;
+    double duration = DEFAULT_DURATION;
+    size_t writes[32];
+    size_t nwrites = 0;
+    uint64_t start, elapsed, records;
+    char *data, *record, *noise;
+    size_t w, k;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:r:w:")) != -1) {
+        switch (opt) {
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'r':
+                record_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                if (nwrites == sizeof(writes) / sizeof(writes[0])) {
+                    usage(argv[0]);
+                }
+                writes[nwrites++] = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (nwrites == 0) {
+        nwrites = sizeof(default_writes) / sizeof(default_writes[0]);
+        memcpy(writes, default_writes, sizeof(default_writes));
+    }
+    if (record_size == 0 || duration <= 0) {
+        usage(argv[0]);
+    }
+
+    data = malloc(record_size);
+    if (!data) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    memset(data, 'a', record_size);
+    data[record_size - 1] = '\n';
+
+    printf("%zu byte record, %.2f s per case\n", record_size, duration);
+    printf("%-8s %-8s %12s %12s\n", "write", "impl", "records/s", "ns/write");
+
+    for (w = 0; w < nwrites; w++) {
+        if (writes[w] == 0) {
+            continue;
+        }
+
+        for (k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+            records = 0;
+            start = now_ns();
+            do {
+                record = impls[k](data, record_size, writes[w]);
+                // Keep an allocation after the record so growing it can't always extend in place
+                noise = malloc(64);
+                if (!record || !noise || memcmp(record, data, record_size) != 0) {
+                    fprintf(stderr, "%s lost the record\n", impl_names[k]);
+                    return EXIT_FAILURE;
+                }
+                free(record);
+                free(noise);
+                records++;
+                elapsed = now_ns() - start;
+            } while (elapsed < duration * 1e9);
+
+            printf("%-8zu %-8s %12.1f %12.2f\n", writes[w], impl_names[k],
+                   (double)records / elapsed * 1e9,
+                   (double)elapsed / ((double)records * ((record_size + writes[w] - 1) / writes[w])));
+        }
+    }
+
+    free(data);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,526 @@
+/*
+ * Load generator for aesdsocket running in session mode (-s).
+ *
+ * Every connection streams records and, every few records, a HISTORY request.
+ * Ingest latency is the time from a record being due to its acknowledgement,
+ * replay latency the time from HISTORY being due to the end of the history,
+ * which is found at the acknowledgement of the record sent after it. With a
+ * rate limit latencies are measured from the scheduled send time, so a server
+ * that stalls is not hidden by the generator slowing down with it.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define DEFAULT_HOST        "127.0.0.1"
+#define DEFAULT_PORT        "9000"
+#define DEFAULT_CONNS       8
+#define DEFAULT_RECORD_SIZE 64
+#define DEFAULT_DURATION    10
+#define DEFAULT_REPLAY_EVERY 100
+#define DEFAULT_WINDOW      1
+#define DRAIN_TIMEOUT_MS    10000
+#define RX_BUFFER_SIZE      65536
+
+#define HISTORY_CMD         "HISTORY\n"
+#define HISTORY_CMD_LEN     (sizeof(HISTORY_CMD) - 1)
+#define SESSION_ACK         "OK\n"
+#define SESSION_ACK_LEN     (sizeof(SESSION_ACK) - 1)
+
+typedef struct config {
+    const char *host;
+    const char *port;
+    int conns;
+    size_t record_size;
+    double rate;            /* records per second over all connections, 0 for no limit */
+    double duration;
+    int replay_every;       /* records between HISTORY requests, 0 for none */
+    int window;             /* requests in flight per connection */
+    int json;
+} config_t;
+
+typedef struct samples {
+    uint64_t *values;
+    size_t count;
+    size_t cap;
+} samples_t;
+
+typedef enum request_type {
+    REQ_RECORD,
+    REQ_HISTORY,
+} request_type_t;
+
+typedef struct request {
+    request_type_t type;
+    uint64_t due;
+} request_t;
+
+typedef struct client {
+    pthread_t thread_id;
+    const config_t *cfg;
+    int index;
+    int fd;
+    char *record;
+    request_t *inflight;    /* ring of window + 1 entries, a HISTORY needs its trailing record */
+    int inflight_cap;
+    int inflight_head;
+    int inflight_count;
+    char rx[RX_BUFFER_SIZE];
+    size_t rx_len;
+    int skip_line;          /* the line being received is too long to be an acknowledgement */
+    uint64_t replay_bytes;
+    uint64_t sent_records;
+    samples_t ingest;
+    samples_t replay;
+    uint64_t replayed_bytes;
+    int failed;
+} client_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int samples_add(samples_t *s, uint64_t value) {
+    uint64_t *values;
+    size_t cap;
+
+    if (s->count == s->cap) {
+        cap = s->cap ? s->cap * 2 : 4096;
+        values = realloc(s->values, cap * sizeof(uint64_t));
+        if (!values) {
+            return -1;
+        }
+        s->values = values;
+        s->cap = cap;
+    }
+    s->values[s->count++] = value;
+    return 0;
+}
+
+static int samples_merge(samples_t *dst, const samples_t *src) {
+    size_t i;
+
+    for (i = 0; i < src->count; i++) {
+        if (samples_add(dst, src->values[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @return the @param q quantile of sorted samples, in microseconds
+ */
+static double samples_quantile(const samples_t *s, double q) {
+    size_t index;
+
+    if (s->count == 0) {
+        return 0;
+    }
+    index = (size_t)(q * s->count);
+    if (index >= s->count) {
+        index = s->count - 1;
+    }
+    return s->values[index] / 1e3;
+}
+
+static int client_connect(client_t *c) {
+    struct addrinfo hints, *res, *p;
+    int yes = 1;
+    int ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((ret = getaddrinfo(c->cfg->host, c->cfg->port, &hints, &res)) != 0) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(ret));
+        return -1;
+    }
+
+    for (p = res; p != NULL; p = p->ai_next) {
+        c->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (c->fd == -1) {
+            continue;
+        }
+        if (connect(c->fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(c->fd);
+        c->fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (c->fd == -1) {
+        fprintf(stderr, "couldnt connect to %s:%s\n", c->cfg->host, c->cfg->port);
+        return -1;
+    }
+
+    // Small records must not wait for delayed acks to be coalesced
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return 0;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    ssize_t bytes;
+
+    while (len > 0) {
+        bytes = send(fd, data, len, MSG_NOSIGNAL);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+static void client_push(client_t *c, request_type_t type, uint64_t due) {
+    request_t *req = &c->inflight[(c->inflight_head + c->inflight_count) % c->inflight_cap];
+
+    req->type = type;
+    req->due = due;
+    c->inflight_count++;
+}
+
+static int client_send_record(client_t *c, uint64_t due) {
+    int len;
+
+    // Unique and never equal to the acknowledgement, so replays can be told apart from it
+    len = snprintf(c->record, c->cfg->record_size, "c%d-%llu", c->index, (unsigned long long)c->sent_records);
+    if ((size_t)len < c->cfg->record_size) {
+        c->record[len] = '.';
+    }
+    c->record[c->cfg->record_size - 1] = '\n';
+
+    if (send_all(c->fd, c->record, c->cfg->record_size) != 0) {
+        return -1;
+    }
+    client_push(c, REQ_RECORD, due);
+    c->sent_records++;
+    return 0;
+}
+
+/**
+ * Matches one acknowledgement to the oldest request in flight. A HISTORY
+ * request completes together with the record right after it.
+ */
+static int client_ack(client_t *c, uint64_t now) {
+    request_t *req;
+    int ret = 0;
+
+    if (c->inflight_count == 0) {
+        fprintf(stderr, "connection %d: unexpected acknowledgement\n", c->index);
+        return -1;
+    }
+
+    req = &c->inflight[c->inflight_head];
+    if (req->type == REQ_HISTORY) {
+        ret |= samples_add(&c->replay, now - req->due);
+        c->replayed_bytes += c->replay_bytes;
+        c->replay_bytes = 0;
+        c->inflight_head = (c->inflight_head + 1) % c->inflight_cap;
+        c->inflight_count--;
+        req = &c->inflight[c->inflight_head];
+    }
+
+    ret |= samples_add(&c->ingest, now - req->due);
+    c->inflight_head = (c->inflight_head + 1) % c->inflight_cap;
+    c->inflight_count--;
+
+    return ret;
+}
+
+static int client_recv(client_t *c) {
+    uint64_t now;
+    ssize_t bytes;
+    char *line;
+    char *newline;
+    size_t len;
+
+    bytes = recv(c->fd, c->rx + c->rx_len, sizeof(c->rx) - c->rx_len, 0);
+    if (bytes <= 0) {
+        if (bytes == -1 && errno == EINTR) {
+            return 0;
+        }
+        fprintf(stderr, "connection %d: %s\n", c->index, bytes == 0 ? "closed by server" : strerror(errno));
+        return -1;
+    }
+    now = now_ns();
+    c->rx_len += bytes;
+
+    line = c->rx;
+    while ((newline = memchr(line, '\n', c->rx_len - (line - c->rx))) != NULL) {
+        len = newline - line + 1;
+        if (!c->skip_line && len == SESSION_ACK_LEN && memcmp(line, SESSION_ACK, SESSION_ACK_LEN) == 0) {
+            if (client_ack(c, now) != 0) {
+                return -1;
+            }
+        } else {
+            c->replay_bytes += len;
+        }
+        c->skip_line = 0;
+        line = newline + 1;
+    }
+
+    len = c->rx_len - (line - c->rx);
+    if (len == sizeof(c->rx)) {
+        // A long replayed record, only its length matters
+        c->replay_bytes += len;
+        c->skip_line = 1;
+        len = 0;
+    }
+    memmove(c->rx, line, len);
+    c->rx_len = len;
+
+    return 0;
+}
+
+static void* client_run(void *arg) {
+    client_t *c = (client_t *)arg;
+    const config_t *cfg = c->cfg;
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(cfg->duration * 1e9);
+    uint64_t interval = cfg->rate > 0 ? (uint64_t)(1e9 * cfg->conns / cfg->rate) : 0;
+    uint64_t next = start + (interval ? interval * c->index / cfg->conns : 0);
+    uint64_t drain_end = 0;
+    uint64_t now;
+    struct pollfd pfd;
+    int timeout;
+
+    pfd.fd = c->fd;
+
+    while (1) {
+        now = now_ns();
+
+        // Everything due and fitting in the window goes out before waiting
+        while (now < end && c->inflight_count < cfg->window && (!interval || next <= now)) {
+            if (cfg->replay_every && c->sent_records > 0 && c->sent_records % cfg->replay_every == 0) {
+                if (send_all(c->fd, HISTORY_CMD, HISTORY_CMD_LEN) != 0) {
+                    goto fail;
+                }
+                client_push(c, REQ_HISTORY, interval ? next : now);
+            }
+            if (client_send_record(c, interval ? next : now) != 0) {
+                goto fail;
+            }
+            next += interval;
+        }
+
+        if (now >= end) {
+            if (c->inflight_count == 0) {
+                break;
+            }
+            if (!drain_end) {
+                drain_end = now + DRAIN_TIMEOUT_MS * 1000000ull;
+            } else if (now >= drain_end) {
+                fprintf(stderr, "connection %d: %d requests unanswered\n", c->index, c->inflight_count);
+                goto fail;
+            }
+        }
+
+        if (now >= end) {
+            timeout = (int)((drain_end - now) / 1000000) + 1;
+        } else if (interval && c->inflight_count < cfg->window) {
+            timeout = (int)(((next < end ? next : end) - now) / 1000000);
+        } else {
+            timeout = (int)((end - now) / 1000000) + 1;
+        }
+
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, timeout) == -1 && errno != EINTR) {
+            goto fail;
+        }
+        if (pfd.revents && client_recv(c) != 0) {
+            goto fail;
+        }
+    }
+
+    return c;
+
+fail:
+    c->failed = 1;
+    return c;
+}
+
+static void print_stats(const config_t *cfg, const char *name, samples_t *s, uint64_t bytes, double elapsed, int last) {
+    qsort(s->values, s->count, sizeof(uint64_t), compare_u64);
+
+    if (cfg->json) {
+        printf("  \"%s\": {\"count\": %zu, \"per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+               "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}%s\n",
+               name, s->count, s->count / elapsed, bytes / elapsed / 1e6,
+               samples_quantile(s, 0.5), samples_quantile(s, 0.99), samples_quantile(s, 0.999),
+               samples_quantile(s, 1.0), last ? "" : ",");
+    } else {
+        printf("%-7s %10zu ops %12.1f ops/s %10.3f MB/s  p50 %9.1f us  p99 %9.1f us  p999 %9.1f us  max %9.1f us\n",
+               name, s->count, s->count / elapsed, bytes / elapsed / 1e6,
+               samples_quantile(s, 0.5), samples_quantile(s, 0.99), samples_quantile(s, 0.999),
+               samples_quantile(s, 1.0));
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-s record size] [-r records/s, 0 unlimited] "
+            "[-d duration seconds] [-R records between replays, 0 none] [-w requests in flight per connection] "
+            "[-j] (json)\n"
+            "The server must run in session mode (aesdsocket -s).\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    config_t cfg = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .conns = DEFAULT_CONNS,
+        .record_size = DEFAULT_RECORD_SIZE,
+        .rate = 0,
+        .duration = DEFAULT_DURATION,
+        .replay_every = DEFAULT_REPLAY_EVERY,
+        .window = DEFAULT_WINDOW,
+        .json = 0,
+    };
+    samples_t ingest = { 0 }, replay = { 0 };
+    uint64_t replayed_bytes = 0;
+    uint64_t start, elapsed_ns;
+    double elapsed;
+    client_t *clients;
+    int failed = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "H:p:c:s:r:d:R:w:j")) != -1) {
+        switch (opt) {
+            case 'H':
+                cfg.host = optarg;
+                break;
+            case 'p':
+                cfg.port = optarg;
+                break;
+            case 'c':
+                cfg.conns = atoi(optarg);
+                break;
+            case 's':
+                cfg.record_size = atol(optarg);
+                break;
+            case 'r':
+                cfg.rate = atof(optarg);
+                break;
+            case 'd':
+                cfg.duration = atof(optarg);
+                break;
+            case 'R':
+                cfg.replay_every = atoi(optarg);
+                break;
+            case 'w':
+                cfg.window = atoi(optarg);
+                break;
+            case 'j':
+                cfg.json = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (cfg.conns <= 0 || cfg.record_size < 2 || cfg.rate < 0 || cfg.duration <= 0 ||
+        cfg.replay_every < 0 || cfg.window <= 0) {
+        usage(argv[0]);
+    }
+
+    clients = calloc(cfg.conns, sizeof(client_t));
+    if (!clients) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < cfg.conns; i++) {
+        clients[i].cfg = &cfg;
+        clients[i].index = i;
+        clients[i].fd = -1;
+        clients[i].inflight_cap = cfg.window + 1;
+        clients[i].inflight = calloc(clients[i].inflight_cap, sizeof(request_t));
+        clients[i].record = malloc(cfg.record_size);
+        if (!clients[i].inflight || !clients[i].record) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+        memset(clients[i].record, '.', cfg.record_size);
+        if (client_connect(&clients[i]) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    start = now_ns();
+    for (i = 0; i < cfg.conns; i++) {
+        if (pthread_create(&clients[i].thread_id, NULL, client_run, &clients[i]) != 0) {
+            fprintf(stderr, "couldnt create client thread\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < cfg.conns; i++) {
+        pthread_join(clients[i].thread_id, NULL);
+        failed |= clients[i].failed;
+        if (samples_merge(&ingest, &clients[i].ingest) != 0 || samples_merge(&replay, &clients[i].replay) != 0) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+        replayed_bytes += clients[i].replayed_bytes;
+        close(clients[i].fd);
+    }
+    elapsed_ns = now_ns() - start;
+    elapsed = elapsed_ns / 1e9;
+
+    if (cfg.json) {
+        printf("{\n  \"connections\": %d, \"record_size\": %zu, \"rate\": %.1f, \"duration\": %.3f, "
+               "\"replay_every\": %d, \"window\": %d, \"errors\": %d,\n",
+               cfg.conns, cfg.record_size, cfg.rate, elapsed, cfg.replay_every, cfg.window, failed);
+        print_stats(&cfg, "ingest", &ingest, ingest.count * cfg.record_size, elapsed, 0);
+        print_stats(&cfg, "replay", &replay, replayed_bytes, elapsed, 1);
+        printf("}\n");
+    } else {
+        printf("%d connections, %zu byte records, %.2f s%s\n", cfg.conns, cfg.record_size, elapsed,
+               failed ? ", some connections failed" : "");
+        print_stats(&cfg, "ingest", &ingest, ingest.count * cfg.record_size, elapsed, 0);
+        print_stats(&cfg, "replay", &replay, replayed_bytes, elapsed, 1);
+    }
+
+    for (i = 0; i < cfg.conns; i++) {
+        free(clients[i].ingest.values);
+        free(clients[i].replay.values);
+        free(clients[i].inflight);
+        free(clients[i].record);
+    }
+    free(clients);
+    free(ingest.values);
+    free(replay.values);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
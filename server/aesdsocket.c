@@ -1,72 +1,61 @@
 // Based on https://beej.us/guide/bgnet/html/#a-simple-stream-server
 
 #include "aesdsocket.h"
+#include "connection.h"
+#include "reactor.h"
+#include "pool.h"
+#include "uring.h"
+#include "storage.h"
+#include "metrics.h"
+#include "timestamp.h"
 #include <getopt.h>
+#include <sys/eventfd.h>
 
-#define USE_AESD_CHAR_DEVICE 1
-
-#if USE_AESD_CHAR_DEVICE == 0
-#include <sys/time.h>
-#endif
-
-#if USE_AESD_CHAR_DEVICE == 1
-#include "../aesd-char-driver/aesd_ioctl.h"
-#endif
-
-int close_server = 0;
+atomic_int close_server = 0;
+int shutdown_fd = -1;
 pthread_mutex_t mutex;
+int listen_backlog = DEFAULT_BACKLOG;
 
-#if USE_AESD_CHAR_DEVICE == 0
-void print_timestamp(int signum){
-    int ret;
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-
-    char timestamp[64]; 
-
-    strftime(timestamp, sizeof(timestamp), "%a, %d %b %Y %H:%M:%S %z", tm_info);
-    ret = pthread_mutex_lock(&mutex);
-    if (ret != 0) {
-        syslog(LOG_ERR, "lock failed with err %d", ret);
-        return;
-    }
-
-    FILE *file = fopen(DATA_FILE, "a");
-    if (!file) {
-        syslog(LOG_ERR, "Failed to open data file");
-        return;
-    }
+void signal_handler(int signum) {
+    uint64_t one = 1;
 
-    fprintf(file, "timestamp:%s\n", timestamp);
+    syslog(LOG_INFO, "Caught signal, exiting");
+    close_server = 1;
 
-    fclose(file);
-    ret = pthread_mutex_unlock(&mutex);
-    if (ret != 0) {
-        syslog(LOG_ERR, "unlock failed with err %d", ret);
+    // Wake up the event loops blocked in epoll_wait
+    if (shutdown_fd != -1 && write(shutdown_fd, &one, sizeof(one)) == -1) {
         return;
     }
 }
-#endif
-
-void signal_handler(int signum) {
-    syslog(LOG_INFO, "Caught signal, exiting");
-    close_server = 1;
-}
 
 void terminate(int sock_fd) {
     if (sock_fd != -1) {
         close(sock_fd);
     }
 
-    #if USE_AESD_CHAR_DEVICE == 0
-    remove(DATA_FILE);
-    #endif
-
     closelog();
 }
 
+/**
+ * Starts a background thread with SIGINT and SIGTERM blocked, the main thread handles the signals.
+ * @return pthread_create() result
+ */
+int spawn_worker(pthread_t *thread, void *(*start)(void *), void *arg) {
+    sigset_t block, old;
+    int ret;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    ret = pthread_create(thread, NULL, start, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return ret;
+}
+
 
-int create_bind_socket() {
+int create_bind_socket(int reuseport) {
     int sockfd = -1;  
     struct addrinfo hints, *servinfo, *p;
     int ret;
@@ -93,6 +82,14 @@ int create_bind_socket() {
             return -1;
         }
 
+        // Every listener of the group binds the same port, the kernel spreads connections between them
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            syslog(LOG_ERR, "couldn't set SO_REUSEPORT");
+            close(sockfd);
+            freeaddrinfo(servinfo);
+            return -1;
+        }
+
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
             close(sockfd);
             continue;
@@ -114,10 +111,9 @@ int create_bind_socket() {
 void* handle_thread(void* thread_param){
     struct thread_data* thread_func_args = (struct thread_data *) thread_param;
 
-    write_to_file(thread_func_args->connfd, thread_func_args->mutex);
+    conn_run(thread_func_args->conn);
 
-    close(thread_func_args->connfd);
-    syslog(LOG_INFO, "Closed connection from %s\n", thread_func_args->connaddr);
+    conn_destroy(thread_func_args->conn);
     thread_func_args->complete = 1;
 
     return thread_func_args;
@@ -125,8 +121,8 @@ void* handle_thread(void* thread_param){
 
 void handle_connection(int sockfd){
     int ret;
-    struct sockaddr conn_addr;
-    socklen_t conn_len = sizeof(conn_addr);
+    struct sockaddr_storage conn_addr;
+    socklen_t conn_len;
     int connfd;
     
     thread_data_t* threadp = NULL;
@@ -134,63 +130,40 @@ void handle_connection(int sockfd){
     SLIST_HEAD(slisthead,thread_data) head;
     SLIST_INIT(&head);
 
-    if (pthread_mutex_init(&mutex, NULL) != 0) { 
-        syslog(LOG_ERR, "couldnt start mutex"); 
-        return; 
-    } 
-
     while (!close_server) {
-        connfd = accept(sockfd, &conn_addr, &conn_len);
+        conn_len = sizeof(conn_addr);
+        connfd = accept(sockfd, (struct sockaddr *)&conn_addr, &conn_len);
         if (connfd == -1) {
-            syslog(LOG_ERR, "couldnt accept conn");
-            continue;
-        }
-        char s[INET6_ADDRSTRLEN > INET_ADDRSTRLEN ? INET6_ADDRSTRLEN : INET_ADDRSTRLEN];
-
-        switch(conn_addr.sa_family) {
-            case AF_INET: {
-                struct sockaddr_in *addr_in = ((struct sockaddr_in *)&conn_addr);
-                inet_ntop(AF_INET, &(addr_in->sin_addr), s, INET_ADDRSTRLEN);
-                break;
-            }
-            case AF_INET6: {
-                struct sockaddr_in6 *addr_in6 = ((struct sockaddr_in6 *)&conn_addr);
-                inet_ntop(AF_INET6, &(addr_in6->sin6_addr), s, INET6_ADDRSTRLEN);
-                break;
+            if (errno != EINTR) {
+                syslog(LOG_ERR, "couldnt accept conn");
             }
-            default:
-                break;
+            continue;
         }
 
-        syslog(LOG_INFO, "Accepted connection from %s\n", s);
-
         threadp = (struct thread_data *)malloc(sizeof(struct thread_data));
-        threadp->connfd = connfd;
-        threadp->mutex = &mutex;
-        threadp->connaddr = s;
-        threadp->complete = 0;									
+        if (!threadp) {
+            syslog(LOG_ERR, "couldnt allocate thread data");
+            close(connfd);
+            continue;
+        }
+        threadp->conn = conn_create(connfd, (struct sockaddr *)&conn_addr);
+        if (!threadp->conn) {
+            close(connfd);
+            free(threadp);
+            continue;
+        }
+        threadp->complete = 0;
 
         ret = pthread_create(&threadp->thread_id, NULL, handle_thread, threadp);
         if (ret != 0) { 
             syslog(LOG_ERR, "couldnt create a new thread");
+            conn_destroy(threadp->conn);
             free(threadp);
             return;
         }
-        
-        ret = pthread_mutex_lock(&mutex);
-        if (ret != 0) {
-            syslog(LOG_ERR, "lock failed with err %d", ret);
-            return;
-        }
 
         SLIST_INSERT_HEAD(&head, threadp, entries);
 
-        ret = pthread_mutex_unlock(&mutex);
-        if (ret != 0) {
-            syslog(LOG_ERR, "unlock failed with err %d", ret);
-            return;
-        }
-
         SLIST_FOREACH_SAFE(threadp, &head, entries, temp){
 			if(threadp->complete){
 				pthread_join(threadp->thread_id,NULL);//Cleanup of thread
@@ -204,161 +177,193 @@ void handle_connection(int sockfd){
         pthread_kill(threadp->thread_id,SIGINT);
         pthread_join(threadp->thread_id,NULL);        
 
-        ret = pthread_mutex_lock(&mutex);
-        if (ret != 0) {
-            syslog(LOG_ERR, "lock failed with err %d", ret);
-            return;
-        }
-
         // Remove thread from list
         SLIST_REMOVE(&head, threadp, thread_data, entries);
 
-        ret = pthread_mutex_unlock(&mutex);
-        if (ret != 0) {
-            syslog(LOG_ERR, "unlock failed with err %d", ret);
-            return;
-        }
-
         // Clean up thread resources
         free(threadp); 
     }
-
-    // Destroy mutex
-    pthread_mutex_destroy(&mutex);
-
-    terminate(sockfd);
-}
-
-void write_to_file(int connfd, pthread_mutex_t* mutex) {
-    int ret;
-    int cmd = 0;
-    char buffer[1024];
-    ssize_t bytes_received;
-
-    while ((bytes_received = recv(connfd, buffer, sizeof(buffer), 0)) > 0) {
-        if (memchr(buffer, '\n', bytes_received) != NULL) {
-            break; 
-        }
-    }
-
-#if USE_AESD_CHAR_DEVICE == 1
-    buffer[bytes_received] = '\0';
-#endif 
-
-    ret = pthread_mutex_lock(mutex);
-    if (ret != 0) {
-        syslog(LOG_ERR, "lock failed with err %d", ret);
-        return;
-    }
-
-    FILE *data_file = fopen(DATA_FILE, "a+");
-    if (!data_file) {
-        syslog(LOG_ERR, "couldnt open file");
-        return;
-    }
-#if USE_AESD_CHAR_DEVICE == 1
-    if (strncmp(buffer, "AESDCHAR_IOCSEEKTO:", 19) == 0) {
-        unsigned int write_cmd, offset;
-        struct aesd_seekto arg;
-        memset(&arg, 0, sizeof(arg));
-        sscanf(buffer + 19, "%u,%u", &write_cmd, &offset);
-
-        syslog(LOG_DEBUG, "received command with %u %u", write_cmd, offset);
-
-        arg.write_cmd = write_cmd;
-        arg.write_cmd_offset = offset;
-
-        if (ioctl(fileno(data_file), AESDCHAR_IOCSEEKTO, &arg) == -1) {
-            fclose(data_file);
-            return;
-        }
-        ssize_t bytes_read;
-        while ((bytes_read = fread(buffer, 1, sizeof(buffer), data_file)) > 0) {
-            send(connfd, buffer, bytes_read, 0);
-        }
-        cmd = 1;
-    }
-    else{
-        int str_size = strlen(buffer);
-        fwrite(buffer, sizeof(char), str_size, data_file);
-    }
-#endif 
-
-#if USE_AESD_CHAR_DEVICE == 0
-    fwrite(buffer, 1, bytes_received, data_file);
-#endif
-    
-    fclose(data_file);
-
-    ret = pthread_mutex_unlock(mutex);
-    if (ret != 0) {
-        syslog(LOG_ERR, "unlock failed with err %d", ret);
-        return;
-    }
-    if(!cmd){
-        write_file_to_sock(connfd, mutex);
-    }
-}
-
-void write_file_to_sock(int connfd, pthread_mutex_t* mutex) {
-    int ret;
-    char buffer[1024];
-    ssize_t bytes_read;
-
-    ret = pthread_mutex_lock(mutex);
-    if (ret != 0) {
-        syslog(LOG_ERR, "lock failed with err %d", ret);
-        return;
-    }
-
-    FILE *data_file = fopen(DATA_FILE, "r");
-    if (!data_file) {
-        syslog(LOG_ERR, "Failed to open data file");
-        return;
-    }
-
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), data_file)) > 0) {
-        send(connfd, buffer, bytes_read, 0);
-    }
-
-    fclose(data_file);
-
-    ret = pthread_mutex_unlock(mutex);
-    if (ret != 0) {
-        syslog(LOG_ERR, "unlock failed with err %d", ret);
-        return;
-    }
 }
 
 int main(int argc, char *argv[]) {
-    #if USE_AESD_CHAR_DEVICE == 0
-    struct itimerval timer;
-    #endif
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = signal_handler;
     int opt;
     int daemon_mode = 0;
-
-    while ((opt = getopt(argc, argv, "d")) != -1) {
+    server_mode_t mode = MODE_THREAD;
+    int loop_threads = 0;   /* per mode default */
+    int pool_workers = DEFAULT_POOL_WORKERS;
+    int pool_queue = DEFAULT_POOL_QUEUE;
+    const char *stats_path = NULL;
+    int timestamp_interval = -1;    /* per backend default */
+
+    while ((opt = getopt(argc, argv, "dm:t:w:q:r:scH:L:T:b:u:i:g:l:pD:y:S:f:")) != -1) {
         switch (opt) {
             case 'd':
                 daemon_mode = 1;
                 break;
+            case 'm':
+                if (strcmp(optarg, "thread") == 0) {
+                    mode = MODE_THREAD;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    mode = MODE_EPOLL;
+                } else if (strcmp(optarg, "pool") == 0) {
+                    mode = MODE_POOL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    mode = MODE_URING;
+                } else if (strcmp(optarg, "reuseport") == 0) {
+                    mode = MODE_REUSEPORT;
+                } else {
+                    fprintf(stderr, "Unknown mode %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                loop_threads = atoi(optarg);
+                if (loop_threads <= 0) {
+                    fprintf(stderr, "Invalid thread count %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                pool_workers = atoi(optarg);
+                if (pool_workers <= 0) {
+                    fprintf(stderr, "Invalid worker count %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                pool_queue = atoi(optarg);
+                if (pool_queue <= 0) {
+                    fprintf(stderr, "Invalid queue size %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                session_mode = 1;
+                break;
+            case 'c':
+                history_cache = 1;
+                break;
+            case 'r':
+                if (atol(optarg) <= 0) {
+                    fprintf(stderr, "Invalid max record size %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                max_record_size = atol(optarg);
+                break;
+            case 'H':
+                if (atol(optarg) <= 0) {
+                    fprintf(stderr, "Invalid high watermark %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                out_high_watermark = atol(optarg);
+                break;
+            case 'L':
+                if (atol(optarg) < 0) {
+                    fprintf(stderr, "Invalid low watermark %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                out_low_watermark = atol(optarg);
+                break;
+            case 'i':
+                timestamp_interval = atoi(optarg);
+                if (timestamp_interval < 0) {
+                    fprintf(stderr, "Invalid timestamp interval %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'g':
+                commit_max_batch = atoi(optarg);
+                if (commit_max_batch <= 0 || commit_max_batch > COMMIT_MAX_BATCH_LIMIT) {
+                    fprintf(stderr, "Invalid commit batch size %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                commit_linger_us = atoi(optarg);
+                if (commit_linger_us < 0) {
+                    fprintf(stderr, "Invalid commit linger time %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                storage_persistent = 1;
+                break;
+            case 'S':
+                if (storage_select(optarg) != 0) {
+                    fprintf(stderr, "Unknown storage backend %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                storage_path = optarg;
+                break;
+            case 'D':
+                if (strcmp(optarg, "none") == 0) {
+                    storage_durability = DURABILITY_NONE;
+                } else if (strcmp(optarg, "periodic") == 0) {
+                    storage_durability = DURABILITY_PERIODIC;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    storage_durability = DURABILITY_BATCH;
+                } else {
+                    fprintf(stderr, "Unknown durability %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'y':
+                sync_interval_ms = atoi(optarg);
+                if (sync_interval_ms <= 0) {
+                    fprintf(stderr, "Invalid sync interval %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'u':
+                stats_path = optarg;
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                if (listen_backlog <= 0) {
+                    fprintf(stderr, "Invalid backlog %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                drain_timeout = atoi(optarg);
+                if (drain_timeout <= 0) {
+                    fprintf(stderr, "Invalid drain timeout %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-d] (daemon)\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-d] (daemon) [-m thread|epoll|pool|uring|reuseport] [-t event loop threads] "
+                        "[-b listen backlog] [-u stats unix socket] "
+                        "[-S char|file|mmap|memory] [-f data path] "
+                        "[-i timestamp interval seconds, 0 disables] [-g max records per commit] "
+                        "[-l commit linger microseconds] [-p] (keep data file) [-D none|periodic|batch] "
+                        "[-y periodic sync milliseconds] "
+                        "[-w pool workers] [-q pool queue size] [-r max record size] [-s] (persistent sessions) [-c] (history cache) "
+                        "[-H output high watermark] [-L output low watermark] [-T drain timeout seconds]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
+    if (out_low_watermark > out_high_watermark) {
+        out_low_watermark = out_high_watermark;
+    }
+
     if (sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1) {
         syslog(LOG_ERR, "couldnt set signals");
         return -1;
     }
 
-    int sockfd = create_bind_socket();
+    int sockfd = create_bind_socket(mode == MODE_REUSEPORT);
+    if (sockfd == -1) {
+        return -1;
+    }
 
-    if (sockfd != -1 && daemon_mode) {
+    if (daemon_mode) {
         pid_t pid, sid;
 
         pid = fork();
@@ -383,27 +388,74 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (listen(sockfd, BACKLOG) == -1) {
+    if (listen(sockfd, listen_backlog) == -1) {
             syslog(LOG_ERR, "couldnt listen to socket");
             close(sockfd);
             return -1;
     }
-    #if USE_AESD_CHAR_DEVICE == 0
-    timer.it_interval.tv_sec = 10;
-    timer.it_interval.tv_usec = 0;
 
-    timer.it_value.tv_sec = 10;
-    timer.it_value.tv_usec = 0;
+    if (pthread_mutex_init(&mutex, NULL) != 0) { 
+        syslog(LOG_ERR, "couldnt start mutex"); 
+        return -1; 
+    } 
+
+    shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (shutdown_fd == -1) {
+        syslog(LOG_ERR, "couldnt create shutdown eventfd");
+        return -1;
+    }
+
+    if (storage_init() != 0) {
+        return -1;
+    }
+
 
-    signal(SIGALRM, print_timestamp);
+    if (stats_path && metrics_serve_start(stats_path) != 0) {
+        return -1;
+    }
 
-    if (setitimer(ITIMER_REAL, &timer, NULL) == -1) {
-        syslog(LOG_ERR, "couldnt set timer");
+    if (timestamp_interval == -1) {
+        timestamp_interval = storage_timestamps() ? DEFAULT_TIMESTAMP_INTERVAL : 0;
+    }
+    if (timestamp_interval > 0 && timestamp_start(timestamp_interval) != 0) {
         return -1;
     }
-    #endif
 
-    handle_connection(sockfd);
+    switch (mode) {
+        case MODE_EPOLL:
+            run_reactor(sockfd, loop_threads ? loop_threads : DEFAULT_LOOP_THREADS, 0);
+            break;
+        case MODE_REUSEPORT:
+            if (loop_threads == 0) {
+                loop_threads = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            run_reactor(sockfd, loop_threads > 0 ? loop_threads : 1, 1);
+            break;
+        case MODE_POOL:
+            run_pool(sockfd, pool_workers, pool_queue);
+            break;
+        case MODE_URING:
+            if (run_uring(sockfd) == 0) {
+                break;
+            }
+            syslog(LOG_WARNING, "io_uring unavailable, falling back to thread per connection");
+            handle_connection(sockfd);
+            break;
+        case MODE_THREAD:
+        default:
+            handle_connection(sockfd);
+            break;
+    }
+
+    timestamp_stop();
+    metrics_serve_stop();
+    storage_cleanup();
+
+    // Destroy mutex
+    pthread_mutex_destroy(&mutex);
+    close(shutdown_fd);
+
+    terminate(sockfd);
 
     return 0; 
 }
\ No newline at end of file
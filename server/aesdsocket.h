@@ -3,37 +3,48 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <syslog.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "queue.h"
 
 #define PORT "9000"
-#define BACKLOG 1
-#define USE_AESD_CHAR_DEVICE 1
+#define DEFAULT_BACKLOG 128
+#define DEFAULT_LOOP_THREADS 2
 
-#if USE_AESD_CHAR_DEVICE == 1
-    #define DATA_FILE            ("/dev/aesdchar")
-#else
-    #define DATA_FILE            ("/var/tmp/aesdsocketdata")
-#endif
+typedef enum server_mode {
+    MODE_THREAD,    /* one thread per accepted connection */
+    MODE_EPOLL,     /* edge-triggered epoll event loops */
+    MODE_POOL,      /* fixed worker pool fed by a bounded connection queue */
+    MODE_URING,     /* single io_uring driving accept, recv and send */
+    MODE_REUSEPORT, /* one SO_REUSEPORT listener and epoll loop per core */
+} server_mode_t;
+
+struct connection;
 
 typedef struct thread_data{
-    pthread_t thread_id; 
-    int connfd;
-    pthread_mutex_t *mutex;
-    int complete;
-    char* connaddr;
-    SLIST_ENTRY(thread_data) entries; 
+    pthread_t thread_id;
+    struct connection *conn;
+    atomic_int complete;    /* set by the connection thread, polled by the accept loop */
+    SLIST_ENTRY(thread_data) entries;
 }thread_data_t;
 
-int create_bind_socket();
+/* Set by the signal handler, polled by the accept loop and every worker thread */
+extern atomic_int close_server;
+extern int shutdown_fd;
+extern pthread_mutex_t mutex;
+extern int listen_backlog;
+
+int create_bind_socket(int reuseport);
 void handle_connection(int sockfd);
-void write_to_file(int connfd, pthread_mutex_t* mutex);
-void write_file_to_sock(int connfd, pthread_mutex_t* mutex);
\ No newline at end of file
+void terminate(int sock_fd);
+int spawn_worker(pthread_t *thread, void *(*start)(void *), void *arg);
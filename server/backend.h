@@ -0,0 +1,65 @@
+#ifndef AESDSOCKET_BACKEND_H
+#define AESDSOCKET_BACKEND_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "storage.h"
+
+/**
+ * Where the records end up. The storage layer group commits appends and
+ * serializes append, replay and seek with the writer lock, so backends only
+ * need to make a reply opened under the lock end on a record boundary.
+ */
+typedef struct storage_backend {
+    const char *name;
+    const char *path;       /* default data path, NULL when nothing is kept outside the process */
+    size_t max_records;     /* records the backend keeps, oldest first out, 0 for no limit */
+    int splice;             /* zero-copy replies go through a pipe, sendfile() can't read the data */
+    int timestamps;         /* timestamp records are written unless asked otherwise */
+
+    int (*open)(const char *path);
+    /* Releases the data, removing it from disk unless storage_persistent is set */
+    void (*close)(void);
+    /* Appends one record per iovec. Returns how many of them are stored, all on success.
+     * Bytes of a record cut short by a failure are removed again so the data ends on a record */
+    int (*append)(struct iovec *iov, int iovcnt);
+    /* Forces appended records to disk, NULL when there is no disk to force them to */
+    int (*sync)(void);
+    /* Opens a reply from byte @param offset of the oldest record kept to the end */
+    int (*replay)(size_t offset, storage_reply_t *reply);
+    /* Opens a reply from byte @param offset of record @param record to the end */
+    int (*seek)(size_t record, size_t offset, storage_reply_t *reply);
+    int (*stats)(storage_stats_t *stats);
+    /* Records kept as found once opened, NULL when max_records always holds */
+    size_t (*capacity)(void);
+} storage_backend_t;
+
+extern const storage_backend_t char_backend;
+extern const storage_backend_t file_backend;
+extern const storage_backend_t mmap_backend;
+extern const storage_backend_t memory_backend;
+
+/**
+ * Writes all of @param iov to @param fd with as few writev() calls as the
+ * kernel allows. @param iov is consumed.
+ * @param torn set to the bytes written of the first iovec not written whole
+ * @return number of iovecs written whole, @param iovcnt on success
+ */
+int storage_writev(int fd, struct iovec *iov, int iovcnt, size_t *torn);
+
+/**
+ * Turns @param fd into a reply from its current position to its current end.
+ * @param fd is owned by the reply afterwards, or closed on failure.
+ * @return 0 on success, -1 on failure
+ */
+int storage_reply_fd(int fd, storage_reply_t *reply);
+
+/**
+ * Opens a reply on the in-memory history, from byte @param offset of the
+ * oldest record kept or, when @param record is not -1, from byte @param
+ * offset of that record.
+ * @return 0 on success, -1 on failure
+ */
+int storage_reply_snapshot(storage_reply_t *reply, long record, size_t offset);
+
+#endif /* AESDSOCKET_BACKEND_H */
@@ -0,0 +1,133 @@
+#include "aesdsocket.h"
+#include "backend.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define RING_SIZE_PARAM "/sys/module/aesdchar/parameters/ring_size"
+
+static struct {
+    const char *path;
+    int fd;             /* open for appending while the server runs */
+} dev = { .fd = -1 };
+
+static int char_open(const char *path) {
+    dev.path = path;
+
+    // The driver creates the node, don't leave a regular file in its place
+    dev.fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (dev.fd == -1) {
+        syslog(LOG_ERR, "couldnt open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void char_close(void) {
+    close(dev.fd);
+    dev.fd = -1;
+}
+
+/**
+ * There's no cutting a torn record out of the device. The driver stores one
+ * ring entry per complete record and reports short writes on record
+ * boundaries, so a write only tears when copying the record in faults.
+ */
+static int char_append(struct iovec *iov, int iovcnt) {
+    size_t torn;
+
+    return storage_writev(dev.fd, iov, iovcnt, &torn);
+}
+
+static int char_replay(size_t offset, storage_reply_t *reply) {
+    int fd;
+
+    fd = open(dev.path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to open data file");
+        return -1;
+    }
+
+    // The driver refuses offsets past its end, reply with nothing then
+    if (offset > 0 && lseek(fd, offset, SEEK_SET) == -1 && lseek(fd, 0, SEEK_END) == -1) {
+        syslog(LOG_ERR, "couldnt seek %s: %s", dev.path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return storage_reply_fd(fd, reply);
+}
+
+static int char_seek(size_t record, size_t offset, storage_reply_t *reply) {
+    struct aesd_seekto arg;
+    int fd;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.write_cmd = record;
+    arg.write_cmd_offset = offset;
+
+    fd = open(dev.path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        syslog(LOG_ERR, "couldnt open file");
+        return -1;
+    }
+
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &arg) == -1) {
+        syslog(LOG_ERR, "seek command failed");
+        close(fd);
+        return -1;
+    }
+
+    return storage_reply_fd(fd, reply);
+}
+
+static int char_stats(storage_stats_t *stats) {
+    off_t end;
+    int fd;
+
+    fd = open(dev.path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    end = lseek(fd, 0, SEEK_END);
+    close(fd);
+    if (end == -1) {
+        return -1;
+    }
+
+    stats->bytes = end;
+    return 0;
+}
+
+/**
+ * The ring size is a module parameter, the driver default applies when it
+ * can't be read.
+ */
+static size_t char_capacity(void) {
+    unsigned long size;
+    FILE *f;
+
+    f = fopen(RING_SIZE_PARAM, "re");
+    if (!f) {
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    if (fscanf(f, "%lu", &size) != 1 || size == 0) {
+        size = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    fclose(f);
+    return size;
+}
+
+const storage_backend_t char_backend = {
+    .name = "char",
+    .path = "/dev/aesdchar",
+    .max_records = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+    .splice = 1,
+    .timestamps = 0,
+    .open = char_open,
+    .close = char_close,
+    .append = char_append,
+    .sync = NULL,
+    .replay = char_replay,
+    .seek = char_seek,
+    .stats = char_stats,
+    .capacity = char_capacity,
+};
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include "aesdsocket.h"
+#include "backend.h"
+#include "maplog.h"
+#include <sys/stat.h>
+
+#define SCAN_BUFFER_SIZE 4096
+
+static struct {
+    const char *path;
+    int fd;             /* open for appending while the server runs, file backend only */
+} data = { .fd = -1 };
+
+/**
+ * Cuts the data file after its last newline. A crash in the middle of a write
+ * may leave part of a record at the end, which would otherwise be glued to
+ * the first record appended after the restart.
+ * @return 0 on success, -1 on failure
+ */
+static int data_recover(void) {
+    char buffer[SCAN_BUFFER_SIZE];
+    const char *newline;
+    off_t end, pos;
+    size_t len;
+    int ret = 0;
+    int fd;
+
+    fd = open(data.path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    end = lseek(fd, 0, SEEK_END);
+    if (end == -1) {
+        close(fd);
+        return -1;
+    }
+
+    for (pos = end; pos > 0; pos -= len) {
+        len = pos < (off_t)sizeof(buffer) ? (size_t)pos : sizeof(buffer);
+        if (pread(fd, buffer, len, pos - len) != (ssize_t)len) {
+            syslog(LOG_ERR, "couldnt read data file: %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        newline = memrchr(buffer, '\n', len);
+        if (newline) {
+            pos = pos - len + (newline - buffer) + 1;
+            break;
+        }
+    }
+
+    if (pos < end) {
+        syslog(LOG_WARNING, "Truncating torn record of %lld bytes at the end of %s",
+               (long long)(end - pos), data.path);
+        if (ftruncate(fd, pos) == -1 || fsync(fd) == -1) {
+            syslog(LOG_ERR, "couldnt truncate data file: %s", strerror(errno));
+            ret = -1;
+        }
+    }
+
+    close(fd);
+    return ret;
+}
+
+static void data_remove(void) {
+    if (!storage_persistent) {
+        remove(data.path);
+    }
+}
+
+static int data_sync(int fd) {
+    while (fdatasync(fd) == -1) {
+        if (errno != EINTR) {
+            syslog(LOG_ERR, "couldnt sync data file: %s", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Progress of a scan for byte offset of a record, carried between buffers */
+typedef struct record_scan {
+    size_t record;      /* newlines still to skip before the record starts */
+    size_t offset;      /* wanted byte, relative to what's left of the record */
+    size_t base;        /* data offset of the next buffer */
+} record_scan_t;
+
+/**
+ * Looks for the wanted byte in the next @param len bytes of the data.
+ * @return 1 with its data offset in @param pos, -1 when the record ends before
+ * it, 0 when it lies in the following bytes
+ */
+static int scan_record(record_scan_t *scan, const char *buf, size_t len, size_t *pos) {
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *newline;
+    size_t avail;
+
+    while (scan->record > 0) {
+        newline = memchr(p, '\n', end - p);
+        if (!newline) {
+            scan->base += len;
+            return 0;
+        }
+        p = newline + 1;
+        scan->record--;
+    }
+
+    newline = memchr(p, '\n', end - p);
+    avail = newline ? (size_t)(newline - p) + 1 : (size_t)(end - p);
+    if (scan->offset < avail) {
+        *pos = scan->base + (p - buf) + scan->offset;
+        return 1;
+    }
+    if (newline) {
+        return -1;
+    }
+
+    scan->offset -= avail;
+    scan->base += len;
+    return 0;
+}
+
+static int file_open(const char *path) {
+    data.path = path;
+    if (data_recover() != 0) {
+        return -1;
+    }
+
+    data.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (data.fd == -1) {
+        syslog(LOG_ERR, "couldnt open data file: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void file_close(void) {
+    close(data.fd);
+    data.fd = -1;
+    data_remove();
+}
+
+static int file_append(struct iovec *iov, int iovcnt) {
+    size_t torn;
+    off_t end;
+    int stored;
+
+    stored = storage_writev(data.fd, iov, iovcnt, &torn);
+    if (stored < iovcnt && torn > 0) {
+        // Appends are serialized, the end of the file is the end of the torn record
+        end = lseek(data.fd, 0, SEEK_END);
+        if (end == -1 || ftruncate(data.fd, end - torn) == -1) {
+            syslog(LOG_ERR, "couldnt truncate torn record: %s", strerror(errno));
+        }
+    }
+    return stored;
+}
+
+static int file_sync(void) {
+    return data_sync(data.fd);
+}
+
+static int file_reply(off_t offset, storage_reply_t *reply) {
+    int fd;
+
+    fd = open(data.path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to open data file");
+        return -1;
+    }
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        syslog(LOG_ERR, "couldnt seek data file: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return storage_reply_fd(fd, reply);
+}
+
+static int file_replay(size_t offset, storage_reply_t *reply) {
+    return file_reply(offset, reply);
+}
+
+static int file_seek(size_t record, size_t offset, storage_reply_t *reply) {
+    record_scan_t scan = { .record = record, .offset = offset, .base = 0 };
+    char buffer[SCAN_BUFFER_SIZE];
+    ssize_t bytes_read;
+    size_t pos;
+    int found = 0;
+    int fd;
+
+    fd = open(data.path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        syslog(LOG_ERR, "couldnt open file");
+        return -1;
+    }
+
+    while (found == 0 && (bytes_read = pread(fd, buffer, sizeof(buffer), scan.base)) != 0) {
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        found = scan_record(&scan, buffer, bytes_read, &pos);
+    }
+    close(fd);
+
+    if (found != 1) {
+        syslog(LOG_ERR, "seek command out of range");
+        return -1;
+    }
+    return file_reply(pos, reply);
+}
+
+static int file_stats(storage_stats_t *stats) {
+    struct stat st;
+
+    if (fstat(data.fd, &st) == -1) {
+        return -1;
+    }
+    stats->bytes = st.st_size;
+    return 0;
+}
+
+static int mmap_open(const char *path) {
+    data.path = path;
+    if (data_recover() != 0) {
+        return -1;
+    }
+    return maplog_open(path);
+}
+
+static void mmap_close(void) {
+    maplog_close();
+    data_remove();
+}
+
+static int mmap_append(struct iovec *iov, int iovcnt) {
+    // The mapping is reserved before anything is copied, the batch is stored whole or not at all
+    return maplog_append(iov, iovcnt) == 0 ? iovcnt : 0;
+}
+
+static int mmap_sync(void) {
+    return maplog_sync();
+}
+
+static int mmap_replay(size_t offset, storage_reply_t *reply) {
+    size_t end = maplog_end();
+
+    reply->map = maplog_data();
+    reply->pos = offset < end ? offset : end;
+    reply->remaining = end - reply->pos;
+    maplog_willneed(reply->pos, reply->remaining);
+    return 0;
+}
+
+static int mmap_seek(size_t record, size_t offset, storage_reply_t *reply) {
+    record_scan_t scan = { .record = record, .offset = offset, .base = 0 };
+    size_t pos;
+
+    if (scan_record(&scan, maplog_data(), maplog_end(), &pos) != 1) {
+        syslog(LOG_ERR, "seek command out of range");
+        return -1;
+    }
+    return mmap_replay(pos, reply);
+}
+
+static int mmap_stats(storage_stats_t *stats) {
+    stats->bytes = maplog_end();
+    return 0;
+}
+
+const storage_backend_t file_backend = {
+    .name = "file",
+    .path = "/var/tmp/aesdsocketdata",
+    .max_records = 0,
+    .splice = 0,
+    .timestamps = 1,
+    .open = file_open,
+    .close = file_close,
+    .append = file_append,
+    .sync = file_sync,
+    .replay = file_replay,
+    .seek = file_seek,
+    .stats = file_stats,
+};
+
+const storage_backend_t mmap_backend = {
+    .name = "mmap",
+    .path = "/var/tmp/aesdsocketdata",
+    .max_records = 0,
+    .splice = 0,
+    .timestamps = 1,
+    .open = mmap_open,
+    .close = mmap_close,
+    .append = mmap_append,
+    .sync = mmap_sync,
+    .replay = mmap_replay,
+    .seek = mmap_seek,
+    .stats = mmap_stats,
+};
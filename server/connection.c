@@ -0,0 +1,840 @@
+#include "aesdsocket.h"
+#include "connection.h"
+#include "storage.h"
+#include "framing.h"
+#include "metrics.h"
+#include <poll.h>
+
+size_t max_record_size = DEFAULT_MAX_RECORD_SIZE;
+int session_mode = 0;
+size_t out_high_watermark = DEFAULT_OUT_HIGH_WATERMARK;
+size_t out_low_watermark = DEFAULT_OUT_LOW_WATERMARK;
+int drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+
+static void get_addr_str(const struct sockaddr *addr, char *s) {
+    s[0] = '\0';
+
+    switch(addr->sa_family) {
+        case AF_INET: {
+            const struct sockaddr_in *addr_in = ((const struct sockaddr_in *)addr);
+            inet_ntop(AF_INET, &(addr_in->sin_addr), s, INET_ADDRSTRLEN);
+            break;
+        }
+        case AF_INET6: {
+            const struct sockaddr_in6 *addr_in6 = ((const struct sockaddr_in6 *)addr);
+            inet_ntop(AF_INET6, &(addr_in6->sin6_addr), s, INET6_ADDRSTRLEN);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+time_t conn_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+connection_t* conn_create(int fd, const struct sockaddr *addr) {
+    int yes = 1;
+    connection_t *conn = malloc(sizeof(connection_t));
+    if (!conn) {
+        syslog(LOG_ERR, "couldnt allocate connection");
+        return NULL;
+    }
+
+    // Acks and replies are small, don't hold them back waiting for the peer's delayed ACK
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1) {
+        syslog(LOG_ERR, "couldn't set TCP_NODELAY: %s", strerror(errno));
+    }
+
+    conn->fd = fd;
+    conn->state = CONN_RECV;
+    conn->rx = NULL;
+    conn->rx_start = 0;
+    conn->rx_scanned = 0;
+    conn->rx_len = 0;
+    conn->rx_cap = 0;
+    TAILQ_INIT(&conn->out);
+    conn->out_bytes = 0;
+    conn->out_paused = 0;
+    conn->out_progress = 0;
+    conn->zerocopy = 1;
+    conn->pipefd[0] = -1;
+    conn->pipefd[1] = -1;
+    conn->pipe_len = 0;
+    get_addr_str(addr, conn->addr);
+    conn->accepted_ns = metrics_now();
+
+    metrics_add(CTR_CONNECTIONS, 1);
+    metrics_add(CTR_ACTIVE, 1);
+    syslog(LOG_INFO, "Accepted connection from %s\n", conn->addr);
+
+    return conn;
+}
+
+static void out_item_free(out_item_t *item) {
+    if (item->type == OUT_REPLY) {
+        storage_close_reply(&item->reply);
+    }
+    free(item->text);
+    free(item->stage);
+    free(item);
+}
+
+void conn_destroy(connection_t *conn) {
+    out_item_t *item;
+
+    while ((item = TAILQ_FIRST(&conn->out)) != NULL) {
+        TAILQ_REMOVE(&conn->out, item, entries);
+        out_item_free(item);
+    }
+    if (conn->pipefd[0] != -1) {
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+    }
+    close(conn->fd);
+    free(conn->rx);
+    metrics_add(CTR_ACTIVE, -1);
+    syslog(LOG_INFO, "Closed connection from %s\n", conn->addr);
+    free(conn);
+}
+
+static void conn_out_push(connection_t *conn, out_item_t *item) {
+    if (TAILQ_EMPTY(&conn->out)) {
+        conn->out_progress = conn_now();
+    }
+    item->queued_ns = metrics_now();
+    TAILQ_INSERT_TAIL(&conn->out, item, entries);
+    conn->out_bytes += item->pending;
+}
+
+/**
+ * Queues a copy of @param data, coalescing with text queued right before it.
+ */
+static int conn_queue_text(connection_t *conn, const char *data, size_t len) {
+    out_item_t *item = TAILQ_LAST(&conn->out, out_queue);
+    size_t cap;
+
+    // Items bigger than OUT_TEXT_SIZE were allocated to fit exactly
+    if (item && item->type == OUT_TEXT && item->text_len <= OUT_TEXT_SIZE &&
+        OUT_TEXT_SIZE - item->text_len >= len) {
+        memcpy(item->text + item->text_len, data, len);
+        item->text_len += len;
+        item->pending += len;
+        conn->out_bytes += len;
+        return 0;
+    }
+
+    item = calloc(1, sizeof(out_item_t));
+    cap = len > OUT_TEXT_SIZE ? len : OUT_TEXT_SIZE;
+    if (!item || !(item->text = malloc(cap))) {
+        free(item);
+        syslog(LOG_ERR, "couldnt queue output");
+        return -1;
+    }
+    item->type = OUT_TEXT;
+    memcpy(item->text, data, len);
+    item->text_len = len;
+    item->pending = len;
+    conn_out_push(conn, item);
+
+    return 0;
+}
+
+/**
+ * Moves an opened reply to the tail of the output queue.
+ */
+static int conn_queue_reply(connection_t *conn, storage_reply_t *reply) {
+    out_item_t *item = calloc(1, sizeof(out_item_t));
+    if (!item) {
+        storage_close_reply(reply);
+        syslog(LOG_ERR, "couldnt queue output");
+        return -1;
+    }
+
+    item->type = OUT_REPLY;
+    item->reply = *reply;
+    item->pending = reply->remaining;
+    conn_out_push(conn, item);
+
+    return 0;
+}
+
+static int out_item_done(connection_t *conn, out_item_t *item) {
+    if (item->type == OUT_TEXT) {
+        return item->text_off == item->text_len;
+    }
+    return item->reply.remaining == 0 && item->stage_off == item->stage_len && conn->pipe_len == 0;
+}
+
+/**
+ * Frees the sent items at the head of the queue.
+ */
+static void conn_out_trim(connection_t *conn) {
+    out_item_t *item;
+
+    while ((item = TAILQ_FIRST(&conn->out)) != NULL && out_item_done(conn, item)) {
+        // A reply that ended early (e.g. evicted by the driver) still counted its full size
+        conn->out_bytes -= item->pending;
+        if (item->type == OUT_REPLY) {
+            metrics_record_since(HIST_REPLAY, item->queued_ns);
+        }
+        TAILQ_REMOVE(&conn->out, item, entries);
+        out_item_free(item);
+    }
+}
+
+/**
+ * Reads the next chunk of a file reply into memory for callers that can't
+ * use storage_transfer().
+ */
+static int out_item_stage(out_item_t *item) {
+    ssize_t bytes;
+
+    if (!item->stage && !(item->stage = malloc(REPLY_CHUNK))) {
+        return -1;
+    }
+
+    bytes = storage_read(&item->reply, item->stage, REPLY_CHUNK);
+    if (bytes <= 0) {
+        // Nothing more to read, the snapshot is done even if shorter than expected
+        item->reply.remaining = 0;
+        item->stage_len = item->stage_off = 0;
+        return bytes;
+    }
+    item->stage_len = bytes;
+    item->stage_off = 0;
+
+    return 0;
+}
+
+int conn_out_iov(connection_t *conn, struct iovec *iov, int max) {
+    out_item_t *item;
+    int n = 0;
+
+    conn_out_trim(conn);
+
+    TAILQ_FOREACH(item, &conn->out, entries) {
+        if (n == max) {
+            break;
+        }
+
+        if (item->type == OUT_TEXT) {
+            iov[n].iov_base = item->text + item->text_off;
+            iov[n].iov_len = item->text_len - item->text_off;
+            n++;
+            continue;
+        }
+
+        if (storage_reply_cached(&item->reply)) {
+            n += storage_reply_iov(&item->reply, iov + n, max - n);
+            if (item->reply.remaining > 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (item->stage_off == item->stage_len && out_item_stage(item) != 0) {
+            break;
+        }
+        if (item->stage_off < item->stage_len) {
+            iov[n].iov_base = item->stage + item->stage_off;
+            iov[n].iov_len = item->stage_len - item->stage_off;
+            n++;
+        }
+        // The rest of a file reply isn't in memory yet, stop here
+        break;
+    }
+
+    return n;
+}
+
+void conn_out_consume(connection_t *conn, size_t len) {
+    out_item_t *item;
+    size_t take;
+
+    conn->out_bytes -= len;
+    conn->out_progress = conn_now();
+    metrics_add(CTR_BYTES_OUT, len);
+
+    while (len > 0 && (item = TAILQ_FIRST(&conn->out)) != NULL) {
+        if (item->type == OUT_TEXT) {
+            take = item->text_len - item->text_off;
+            if (take > len) {
+                take = len;
+            }
+            item->text_off += take;
+        } else if (storage_reply_cached(&item->reply)) {
+            take = item->reply.remaining;
+            if (take > len) {
+                take = len;
+            }
+            storage_reply_consume(&item->reply, take);
+        } else {
+            take = item->stage_len - item->stage_off;
+            if (take > len) {
+                take = len;
+            }
+            item->stage_off += take;
+        }
+
+        item->pending -= take;
+        len -= take;
+        conn_out_trim(conn);
+    }
+}
+
+int conn_out_expired(connection_t *conn, time_t now) {
+    return !TAILQ_EMPTY(&conn->out) && now - conn->out_progress >= drain_timeout;
+}
+
+int conn_wants_input(connection_t *conn) {
+    if (conn->out_paused && conn->out_bytes <= out_low_watermark) {
+        conn->out_paused = 0;
+    } else if (!conn->out_paused && conn->out_bytes >= out_high_watermark) {
+        conn->out_paused = 1;
+    }
+
+    return conn->state == CONN_RECV && !conn->out_paused;
+}
+
+/**
+ * Makes room for at least RECV_BUFFER_SIZE more bytes in the receive buffer.
+ * Consumed records are dropped from the front first and the buffer grows
+ * geometrically, so reassembly stays linear in the record size.
+ * @return bytes available at the end of the buffer, 0 on allocation failure
+ */
+static size_t conn_rx_reserve(connection_t *conn, size_t want) {
+    size_t cap;
+    char *rx;
+
+    if (conn->rx_start > 0) {
+        conn->rx_len -= conn->rx_start;
+        conn->rx_scanned -= conn->rx_start;
+        memmove(conn->rx, conn->rx + conn->rx_start, conn->rx_len);
+        conn->rx_start = 0;
+    }
+
+    if (conn->rx_cap - conn->rx_len >= want) {
+        return conn->rx_cap - conn->rx_len;
+    }
+
+    cap = conn->rx_cap ? conn->rx_cap * 2 : RECV_BUFFER_SIZE;
+    if (cap < conn->rx_len + want) {
+        cap = conn->rx_len + want;
+    }
+
+    rx = realloc(conn->rx, cap);
+    if (!rx) {
+        syslog(LOG_ERR, "couldnt grow receive buffer to %zu bytes", cap);
+        return 0;
+    }
+    conn->rx = rx;
+    conn->rx_cap = cap;
+
+    return conn->rx_cap - conn->rx_len;
+}
+
+/**
+ * A record that is a request rather than data. Handlers get the arguments
+ * following the name, newline included.
+ */
+typedef struct conn_command {
+    const char *name;
+    size_t len;
+    int exact;          /* the whole record is the name, no arguments */
+    int session_only;   /* stored as data outside of session mode */
+    int (*handle)(connection_t *conn, const char *args, size_t len);
+} conn_command_t;
+
+/**
+ * Parses exactly @param count comma separated decimal values from command arguments, only the
+ * closing newline may follow the last one. Signs, spaces and values above @param max are refused.
+ * @return 0 on success, -1 when the arguments are malformed
+ */
+static int conn_parse_args(const char *args, size_t len, unsigned long long max,
+                           unsigned long long *values, int count) {
+    char buf[64];
+    char *p = buf, *end;
+    int i;
+
+    if (len > 0 && args[len - 1] == '\n') {
+        len--;
+    }
+    if (len >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, args, len);
+    buf[len] = '\0';
+
+    for (i = 0; i < count; i++) {
+        if (i > 0 && *p++ != ',') {
+            return -1;
+        }
+        // strtoull would skip spaces and take a sign, "-1" wrapping around to ULLONG_MAX
+        if (*p < '0' || *p > '9') {
+            return -1;
+        }
+        errno = 0;
+        values[i] = strtoull(p, &end, 10);
+        if (errno == ERANGE || values[i] > max) {
+            return -1;
+        }
+        p = end;
+    }
+
+    return *p == '\0' ? 0 : -1;
+}
+
+static int conn_reply(connection_t *conn, int ret, storage_reply_t *reply) {
+    if (ret != 0) {
+        return -1;
+    }
+    return conn_queue_reply(conn, reply);
+}
+
+static int conn_cmd_history(connection_t *conn, const char *args, size_t len) {
+    storage_reply_t reply;
+
+    return conn_reply(conn, storage_open_reply(&reply), &reply);
+}
+
+static int conn_cmd_stats(connection_t *conn, const char *args, size_t len) {
+    size_t text_len;
+    char *text;
+    int ret;
+
+    text = metrics_format(&text_len);
+    if (!text) {
+        return -1;
+    }
+    ret = conn_queue_text(conn, text, text_len);
+    free(text);
+
+    return ret;
+}
+
+static int conn_cmd_seek(connection_t *conn, const char *args, size_t len) {
+    unsigned long long values[2];
+    storage_reply_t reply;
+
+    if (conn_parse_args(args, len, SIZE_MAX, values, 2) != 0) {
+        syslog(LOG_ERR, "malformed seek command");
+        return -1;
+    }
+    syslog(LOG_DEBUG, "received command with %llu %llu", values[0], values[1]);
+
+    return conn_reply(conn, storage_seek(values[0], values[1], &reply), &reply);
+}
+
+static int conn_cmd_tail(connection_t *conn, const char *args, size_t len) {
+    unsigned long long count;
+    storage_reply_t reply;
+
+    if (conn_parse_args(args, len, SIZE_MAX, &count, 1) != 0) {
+        syslog(LOG_ERR, "malformed TAIL command");
+        return -1;
+    }
+
+    return conn_reply(conn, storage_open_tail(count, &reply), &reply);
+}
+
+static int conn_cmd_range(connection_t *conn, const char *args, size_t len) {
+    unsigned long long values[2];
+    storage_reply_t reply;
+
+    if (conn_parse_args(args, len, SIZE_MAX, values, 2) != 0) {
+        syslog(LOG_ERR, "malformed RANGE command");
+        return -1;
+    }
+
+    return conn_reply(conn, storage_open_range(values[0], values[1], &reply), &reply);
+}
+
+static int conn_cmd_since(connection_t *conn, const char *args, size_t len) {
+    unsigned long long seq;
+    storage_reply_t reply;
+    uint64_t head;
+    char line[32];
+    int line_len;
+
+    // Sequence numbers are 64 bit even where size_t isn't
+    if (conn_parse_args(args, len, UINT64_MAX, &seq, 1) != 0) {
+        syslog(LOG_ERR, "malformed SINCE command");
+        return -1;
+    }
+
+    if (storage_open_since(seq, &reply, &head) != 0) {
+        return -1;
+    }
+
+    line_len = snprintf(line, sizeof(line), SINCE_HEAD, (unsigned long long)head);
+    if (conn_queue_text(conn, line, line_len) != 0) {
+        storage_close_reply(&reply);
+        return -1;
+    }
+    return conn_queue_reply(conn, &reply);
+}
+
+static const conn_command_t commands[] = {
+    { HISTORY_CMD,  HISTORY_CMD_LEN,    1, 1, conn_cmd_history },
+    { STATS_CMD,    STATS_CMD_LEN,      1, 1, conn_cmd_stats },
+    { SEEKTO_CMD,   SEEKTO_CMD_LEN,     0, 0, conn_cmd_seek },
+    { TAIL_CMD,     TAIL_CMD_LEN,       0, 0, conn_cmd_tail },
+    { RANGE_CMD,    RANGE_CMD_LEN,      0, 0, conn_cmd_range },
+    { SINCE_CMD,    SINCE_CMD_LEN,      0, 0, conn_cmd_since },
+};
+
+static const conn_command_t* conn_find_command(const char *record, size_t len) {
+    const conn_command_t *cmd;
+    size_t i;
+
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        cmd = &commands[i];
+        if ((cmd->session_only && !session_mode) || len < cmd->len || (cmd->exact && len != cmd->len)) {
+            continue;
+        }
+        if (memcmp(record, cmd->name, cmd->len) == 0) {
+            return cmd;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Accounts for @param len bytes just received.
+ */
+static void conn_received(connection_t *conn, size_t len) {
+    metrics_add(CTR_BYTES_IN, len);
+    if (conn->accepted_ns) {
+        metrics_record_since(HIST_FIRST_BYTE, conn->accepted_ns);
+        conn->accepted_ns = 0;
+    }
+}
+
+/**
+ * Outside of session mode, stores @param record along with every complete
+ * record received after it and queues the whole history as the reply. Bytes
+ * following the last newline are dropped with the connection.
+ * @return 0 on success, -1 on failure
+ */
+/**
+ * Closes the connection when a record, complete or not, is over max_record_size.
+ * @return 0 when the record fits, -1 when the connection was closed
+ */
+static int conn_check_record_size(connection_t *conn, size_t len) {
+    if (len <= max_record_size) {
+        return 0;
+    }
+    syslog(LOG_ERR, "Record from %s exceeds %zu bytes, closing", conn->addr, max_record_size);
+    conn->state = CONN_CLOSED;
+    return -1;
+}
+
+static int conn_store_received(connection_t *conn, const char *record, size_t len) {
+    const char *end = conn->rx + conn->rx_len;
+    const char *newline;
+    storage_reply_t reply;
+
+    while ((newline = memchr(record + len, '\n', end - (record + len))) != NULL) {
+        if (storage_append(record, len) != 0) {
+            return -1;
+        }
+        record += len;
+        len = newline + 1 - record;
+        if (conn_check_record_size(conn, len) != 0) {
+            return -1;
+        }
+    }
+    conn->rx_start = record + len - conn->rx;
+    conn->rx_scanned = conn->rx_start;
+
+    if (storage_store(record, len, &reply) != 0 || conn_queue_reply(conn, &reply) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Handles one complete record. Outside of session mode the record and the
+ * ones received with it are stored, the whole history becomes the reply and
+ * no further input is read. In session
+ * mode records are only acknowledged, and the history is replayed on request.
+ * Commands are answered with their reply in both modes.
+ */
+static void conn_handle_record(connection_t *conn, const char *record, size_t len) {
+    const conn_command_t *cmd = conn_find_command(record, len);
+
+    if (cmd) {
+        if (cmd->handle(conn, record + cmd->len, len - cmd->len) != 0) {
+            conn->state = CONN_CLOSED;
+        } else if (!session_mode) {
+            conn->state = CONN_DRAIN;
+        }
+        return;
+    }
+
+    if (!session_mode) {
+        conn->state = conn_store_received(conn, record, len) != 0 ? CONN_CLOSED : CONN_DRAIN;
+        return;
+    }
+
+    if (storage_append(record, len) != 0 || conn_queue_text(conn, SESSION_ACK, SESSION_ACK_LEN) != 0) {
+        conn->state = CONN_CLOSED;
+    }
+}
+
+/**
+ * Handles the complete records already sitting in the receive buffer, in
+ * order, while the output queue stays under the high watermark.
+ */
+static void conn_dispatch(connection_t *conn) {
+    size_t newlines[FRAME_BATCH];
+    size_t count, base, i;
+    char *record;
+    size_t len;
+
+    while (conn_wants_input(conn)) {
+        // Frame a batch of records in one pass, a recv often carries many
+        base = conn->rx_scanned;
+        count = frame_scan(conn->rx + base, conn->rx_len - base, newlines, FRAME_BATCH);
+        if (count == 0) {
+            conn->rx_scanned = conn->rx_len;
+            break;
+        }
+
+        for (i = 0; i < count && conn_wants_input(conn); i++) {
+            record = conn->rx + conn->rx_start;
+            len = base + newlines[i] + 1 - conn->rx_start;
+            if (conn_check_record_size(conn, len) != 0) {
+                return;
+            }
+            conn->rx_start += len;
+            conn->rx_scanned = conn->rx_start;
+
+            conn_handle_record(conn, record, len);
+        }
+    }
+
+    if (conn->state == CONN_RECV && conn->rx_scanned == conn->rx_len) {
+        conn_check_record_size(conn, conn->rx_len - conn->rx_start);
+    }
+}
+
+static void conn_eof(connection_t *conn) {
+    storage_reply_t reply;
+
+    conn->state = CONN_DRAIN;
+    if (session_mode) {
+        return;
+    }
+
+    // Peer finished sending without a newline, reply with the history only
+    if (storage_open_reply(&reply) != 0 || conn_queue_reply(conn, &reply) != 0) {
+        conn->state = CONN_CLOSED;
+    }
+}
+
+/**
+ * @return 0 after making progress, CONN_WANT_READ when the socket would block
+ */
+static int conn_recv(connection_t *conn) {
+    ssize_t bytes_received;
+    size_t space;
+
+    conn_dispatch(conn);
+    if (!conn_wants_input(conn)) {
+        return 0;
+    }
+
+    space = conn_rx_reserve(conn, RECV_BUFFER_SIZE);
+    if (space == 0) {
+        conn->state = CONN_CLOSED;
+        return 0;
+    }
+
+    bytes_received = recv(conn->fd, conn->rx + conn->rx_len, space, 0);
+    if (bytes_received == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return CONN_WANT_READ;
+        }
+        if (errno != EINTR || close_server) {
+            conn->state = CONN_CLOSED;
+        }
+        return 0;
+    }
+
+    if (bytes_received == 0) {
+        conn_eof(conn);
+    } else {
+        conn->rx_len += bytes_received;
+        conn_received(conn, bytes_received);
+        conn_dispatch(conn);
+    }
+    return 0;
+}
+
+void conn_feed(connection_t *conn, const char *data, size_t len) {
+    if (len == 0) {
+        conn_eof(conn);
+        return;
+    }
+
+    if (conn_rx_reserve(conn, len) == 0) {
+        conn->state = CONN_CLOSED;
+        return;
+    }
+    memcpy(conn->rx + conn->rx_len, data, len);
+    conn->rx_len += len;
+    conn_received(conn, len);
+
+    conn_dispatch(conn);
+}
+
+void conn_resume(connection_t *conn) {
+    conn_dispatch(conn);
+}
+
+/**
+ * @return 0 after making progress, CONN_WANT_WRITE when the socket would block
+ */
+static int conn_send_error(connection_t *conn) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return CONN_WANT_WRITE;
+    }
+    if (errno != EINTR || close_server) {
+        conn->state = CONN_CLOSED;
+    }
+    return 0;
+}
+
+static int conn_send_zerocopy(connection_t *conn, out_item_t *item) {
+    ssize_t bytes;
+
+    bytes = storage_transfer(&item->reply, conn->fd, conn->pipefd, &conn->pipe_len);
+    if (bytes > 0) {
+        conn->out_bytes -= bytes;
+        conn->out_progress = conn_now();
+        metrics_add(CTR_BYTES_OUT, bytes);
+        item->pending -= bytes;
+        conn_out_trim(conn);
+        return 0;
+    }
+    if (bytes == 0) {
+        item->reply.remaining = 0;
+        conn_out_trim(conn);
+        return 0;
+    }
+
+    if ((errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) && conn->pipe_len == 0) {
+        // Not supported for this descriptor, read through memory instead
+        conn->zerocopy = 0;
+        return 0;
+    }
+
+    return conn_send_error(conn);
+}
+
+/**
+ * Sends from the head of the output queue: file replies with sendfile/splice,
+ * everything else gathered into one non-blocking sendmsg.
+ */
+static int conn_flush(connection_t *conn) {
+    struct iovec iov[OUT_MAX_IOV];
+    struct msghdr msg;
+    out_item_t *item = TAILQ_FIRST(&conn->out);
+    ssize_t bytes;
+    int iovcnt;
+
+    if (item->type == OUT_REPLY && conn->zerocopy && !storage_reply_cached(&item->reply) &&
+        item->stage_off == item->stage_len) {
+        return conn_send_zerocopy(conn, item);
+    }
+
+    iovcnt = conn_out_iov(conn, iov, OUT_MAX_IOV);
+    if (iovcnt == 0) {
+        conn_out_trim(conn);
+        if (!TAILQ_EMPTY(&conn->out)) {
+            syslog(LOG_ERR, "couldnt stage reply for %s", conn->addr);
+            conn->state = CONN_CLOSED;
+        }
+        return 0;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    bytes = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    if (bytes == -1) {
+        return conn_send_error(conn);
+    }
+
+    conn_out_consume(conn, bytes);
+    return 0;
+}
+
+int conn_process(connection_t *conn) {
+    int want;
+
+    while (conn->state != CONN_CLOSED) {
+        want = 0;
+
+        if (!TAILQ_EMPTY(&conn->out)) {
+            if (conn_flush(conn) == 0) {
+                continue;
+            }
+            want |= CONN_WANT_WRITE;
+        } else if (conn->state == CONN_DRAIN) {
+            conn->state = CONN_CLOSED;
+            break;
+        }
+
+        // Keep reading while the client can't take output, up to the high watermark
+        if (conn_wants_input(conn)) {
+            if (conn_recv(conn) == 0) {
+                continue;
+            }
+            // Records buffered while paused may have queued replies before recv() blocked
+            if (!(want & CONN_WANT_WRITE) && !TAILQ_EMPTY(&conn->out)) {
+                continue;
+            }
+            want |= CONN_WANT_READ;
+        }
+
+        return want;
+    }
+
+    return CONN_DONE;
+}
+
+void conn_run(connection_t *conn) {
+    struct pollfd pfd;
+    int want;
+    int flags;
+    int ret;
+
+    flags = fcntl(conn->fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        syslog(LOG_ERR, "couldnt set connection non-blocking");
+        return;
+    }
+
+    while ((want = conn_process(conn)) != CONN_DONE) {
+        pfd.fd = conn->fd;
+        pfd.events = ((want & CONN_WANT_READ) ? POLLIN : 0) | ((want & CONN_WANT_WRITE) ? POLLOUT : 0);
+        pfd.revents = 0;
+
+        ret = poll(&pfd, 1, (want & CONN_WANT_WRITE) ? drain_timeout * 1000 : -1);
+        if (ret == -1 && errno == EINTR && close_server) {
+            break;
+        }
+        if (ret == 0 && conn_out_expired(conn, conn_now())) {
+            syslog(LOG_INFO, "Client %s stopped reading, disconnecting", conn->addr);
+            break;
+        }
+    }
+}
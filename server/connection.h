@@ -0,0 +1,171 @@
+#ifndef AESDSOCKET_CONNECTION_H
+#define AESDSOCKET_CONNECTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "queue.h"
+#include "storage.h"
+
+#define RECV_BUFFER_SIZE 1024
+#define DEFAULT_MAX_RECORD_SIZE (1024 * 1024)
+
+#define OUT_TEXT_SIZE 4096
+#define OUT_MAX_IOV 64
+#define DEFAULT_OUT_HIGH_WATERMARK (4 * 1024 * 1024)
+#define DEFAULT_OUT_LOW_WATERMARK (1024 * 1024)
+#define DEFAULT_DRAIN_TIMEOUT 30
+
+#define HISTORY_CMD         "HISTORY\n"
+#define HISTORY_CMD_LEN     (sizeof(HISTORY_CMD) - 1)
+#define STATS_CMD           "STATS\n"
+#define STATS_CMD_LEN       (sizeof(STATS_CMD) - 1)
+#define SEEKTO_CMD          "AESDCHAR_IOCSEEKTO:"
+#define SEEKTO_CMD_LEN      (sizeof(SEEKTO_CMD) - 1)
+#define TAIL_CMD            "TAIL "
+#define TAIL_CMD_LEN        (sizeof(TAIL_CMD) - 1)
+#define RANGE_CMD           "RANGE "
+#define RANGE_CMD_LEN       (sizeof(RANGE_CMD) - 1)
+#define SINCE_CMD           "SINCE "
+#define SINCE_CMD_LEN       (sizeof(SINCE_CMD) - 1)
+#define SINCE_HEAD          "HEAD %llu\n"
+#define SESSION_ACK         "OK\n"
+#define SESSION_ACK_LEN     (sizeof(SESSION_ACK) - 1)
+#define ADDR_STR_LEN (INET6_ADDRSTRLEN > INET_ADDRSTRLEN ? INET6_ADDRSTRLEN : INET_ADDRSTRLEN)
+
+typedef enum conn_state {
+    CONN_RECV,      /* reading records */
+    CONN_DRAIN,     /* no more input, close once the output queue is sent */
+    CONN_CLOSED,
+} conn_state_t;
+
+/* Return values of conn_process(), CONN_WANT_READ and CONN_WANT_WRITE may be combined */
+#define CONN_WANT_READ  1
+#define CONN_WANT_WRITE 2
+#define CONN_DONE       4
+
+typedef enum out_type {
+    OUT_TEXT,       /* bytes owned by the item */
+    OUT_REPLY,      /* history streamed from storage */
+} out_type_t;
+
+/**
+ * One entry of a connection's output queue
+ */
+typedef struct out_item {
+    out_type_t type;
+    size_t pending;         /* bytes of this item not sent yet */
+    char *text;
+    size_t text_len;
+    size_t text_off;
+    storage_reply_t reply;
+    char *stage;            /* file replies read through memory when not using sendfile/splice */
+    size_t stage_len;
+    size_t stage_off;
+    uint64_t queued_ns;     /* metrics_now() when queued */
+    TAILQ_ENTRY(out_item) entries;
+} out_item_t;
+
+typedef struct connection {
+    int fd;
+    conn_state_t state;
+    char addr[ADDR_STR_LEN];
+    uint64_t accepted_ns;   /* metrics_now() at accept, 0 once the first byte arrived */
+    char *rx;               /* reassembly buffer, grows as records need */
+    size_t rx_start;        /* first byte not yet handed to storage */
+    size_t rx_scanned;      /* bytes before this offset hold no newline */
+    size_t rx_len;
+    size_t rx_cap;
+    TAILQ_HEAD(out_queue, out_item) out;
+    size_t out_bytes;       /* bytes queued and not sent yet */
+    int out_paused;         /* reading stopped until out_bytes drops to the low watermark */
+    time_t out_progress;    /* last time output was queued on an empty queue or sent */
+    int zerocopy;           /* cleared once the kernel refuses sendfile/splice */
+    int pipefd[2];
+    size_t pipe_len;
+    LIST_ENTRY(connection) entries;
+} connection_t;
+
+/* Longest record accepted from a client, newline included */
+extern size_t max_record_size;
+
+/**
+ * When set, connections stay open across records: each record is acknowledged
+ * with SESSION_ACK in order and the history is only sent after HISTORY_CMD.
+ * STATS_CMD replies with the metrics_format() text. SEEKTO_CMD "<record>,<offset>",
+ * TAIL_CMD "<count>", RANGE_CMD "<first>,<count>" and SINCE_CMD "<sequence>" are
+ * commands in both modes. SINCE_CMD replies with a SINCE_HEAD line holding the
+ * sequence number of the last record sent before the records themselves.
+ */
+extern int session_mode;
+
+/* Queued output above which a connection stops reading records */
+extern size_t out_high_watermark;
+/* Queued output below which a paused connection reads records again */
+extern size_t out_low_watermark;
+/* Seconds a connection may have output queued without sending any of it */
+extern int drain_timeout;
+
+connection_t* conn_create(int fd, const struct sockaddr *addr);
+void conn_destroy(connection_t *conn);
+
+/**
+ * Advances the connection state machine as far as the non-blocking socket
+ * allows. Returns CONN_WANT_READ and/or CONN_WANT_WRITE once the socket would
+ * block, and CONN_DONE when the connection is finished and should be destroyed.
+ */
+int conn_process(connection_t *conn);
+
+/**
+ * Serves the connection on the calling thread until it is done, waiting for
+ * the socket with poll() and enforcing drain_timeout.
+ */
+void conn_run(connection_t *conn);
+
+/**
+ * @return nonzero when output has been queued for drain_timeout seconds
+ * without the client reading any of it
+ */
+int conn_out_expired(connection_t *conn, time_t now);
+
+/**
+ * @return CLOCK_MONOTONIC seconds, the clock used for drain deadlines
+ */
+time_t conn_now(void);
+
+/**
+ * Runs the receive side of the state machine on data that was already read
+ * from the socket by the caller (e.g. the io_uring backend). A @param len of 0
+ * signals the peer closed its side.
+ */
+void conn_feed(connection_t *conn, const char *data, size_t len);
+
+/**
+ * Handles the records left in the receive buffer while output was paused, for
+ * callers feeding the connection themselves once conn_out_consume() drained
+ * the output queue below the low watermark.
+ */
+void conn_resume(connection_t *conn);
+
+/**
+ * @return nonzero when the connection wants more input, i.e. it is reading
+ * records and its output queue is under the watermarks
+ */
+int conn_wants_input(connection_t *conn);
+
+/**
+ * Describes the head of the output queue as up to @param max iovecs without
+ * consuming it, for callers doing their own sends (e.g. the io_uring backend).
+ * @return number of iovecs filled, 0 when there's nothing to send
+ */
+int conn_out_iov(connection_t *conn, struct iovec *iov, int max);
+
+/**
+ * Drops @param len sent bytes from the head of the output queue.
+ */
+void conn_out_consume(connection_t *conn, size_t len);
+
+#endif /* AESDSOCKET_CONNECTION_H */
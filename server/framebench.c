@@ -0,0 +1,139 @@
+/*
+ * Microbenchmark of the record framing on the receive path.
+ *
+ * Frames a buffer of newline terminated records the way conn_dispatch() does,
+ * a batch of FRAME_BATCH newlines per scan, with every frame_scan()
+ * implementation the CPU supports. "memchr" is the one memchr() call per
+ * record the receive path used before.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include "framing.h"
+
+#define DEFAULT_BUFFER_SIZE (4 * 1024 * 1024)
+#define DEFAULT_DURATION    0.5
+
+static const size_t default_sizes[] = { 8, 32, 128, 512, 2048, 8192 };
+static const char *impl_names[] = { "memchr", "sse2", "avx2" };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void fill_records(char *buf, size_t len, size_t record_size) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (i + 1) % record_size == 0 ? '\n' : 'a' + i % 26;
+    }
+}
+
+/**
+ * @return records framed in @param buf
+ */
+static size_t frame_all(const char *buf, size_t len) {
+    size_t newlines[FRAME_BATCH];
+    size_t records = 0;
+    size_t scanned = 0;
+    size_t count;
+
+    while ((count = frame_scan(buf + scanned, len - scanned, newlines, FRAME_BATCH)) > 0) {
+        records += count;
+        scanned += newlines[count - 1] + 1;
+    }
+    return records;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b buffer bytes] [-d seconds per case] [-s record size, repeatable]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    size_t buffer_size = DEFAULT_BUFFER_SIZE;
+    double duration = DEFAULT_DURATION;
+    size_t sizes[32];
+    size_t nsizes = 0;
+    size_t records, expected;
+    uint64_t start, elapsed, rounds;
+    char *buf;
+    size_t s, k;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:d:s:")) != -1) {
+        switch (opt) {
+            case 'b':
+                buffer_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 's':
+                if (nsizes == sizeof(sizes) / sizeof(sizes[0])) {
+                    usage(argv[0]);
+                }
+                sizes[nsizes++] = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (nsizes == 0) {
+        nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+    if (buffer_size == 0 || duration <= 0) {
+        usage(argv[0]);
+    }
+
+    buf = malloc(buffer_size);
+    if (!buf) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("%zu byte buffer, %.2f s per case\n", buffer_size, duration);
+    printf("%-8s %-7s %12s %12s %10s\n", "record", "impl", "MB/s", "records/s", "ns/record");
+
+    for (s = 0; s < nsizes; s++) {
+        if (sizes[s] == 0) {
+            continue;
+        }
+        fill_records(buf, buffer_size, sizes[s]);
+        expected = buffer_size / sizes[s];
+
+        for (k = 0; k < sizeof(impl_names) / sizeof(impl_names[0]); k++) {
+            if (frame_select(impl_names[k]) != 0) {
+                continue;
+            }
+
+            rounds = 0;
+            start = now_ns();
+            do {
+                records = frame_all(buf, buffer_size);
+                if (records != expected) {
+                    fprintf(stderr, "%s framed %zu records, expected %zu\n", impl_names[k], records, expected);
+                    return EXIT_FAILURE;
+                }
+                rounds++;
+                elapsed = now_ns() - start;
+            } while (elapsed < duration * 1e9);
+
+            printf("%-8zu %-7s %12.1f %12.0f %10.2f\n", sizes[s], impl_names[k],
+                   (double)buffer_size * rounds / elapsed * 1e3,
+                   (double)expected * rounds / elapsed * 1e9,
+                   (double)elapsed / ((double)expected * rounds));
+        }
+    }
+
+    free(buf);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,166 @@
+#include "framing.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAMING_X86 1
+#endif
+
+typedef size_t (*frame_scan_fn)(const char *buf, size_t len, size_t *pos, size_t max);
+
+typedef struct frame_impl_desc {
+    const char *name;
+    frame_scan_fn scan;
+    int (*supported)(void);
+} frame_impl_desc_t;
+
+static size_t scan_memchr(const char *buf, size_t len, size_t *pos, size_t max) {
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *newline;
+    size_t n = 0;
+
+    while (n < max && (newline = memchr(p, '\n', end - p)) != NULL) {
+        pos[n++] = newline - buf;
+        p = newline + 1;
+    }
+    return n;
+}
+
+static int always(void) {
+    return 1;
+}
+
+#ifdef FRAMING_X86
+/**
+ * Stores the offsets of the bits set in @param mask, the compare result for
+ * the 64 bytes at @param base.
+ */
+static inline size_t scan_mask(uint64_t mask, size_t base, size_t *pos, size_t n, size_t max) {
+    while (mask && n < max) {
+        pos[n++] = base + __builtin_ctzll(mask);
+        mask &= mask - 1;
+    }
+    return n;
+}
+
+static inline size_t scan_tail(const char *buf, size_t i, size_t len, size_t *pos, size_t n, size_t max) {
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\n') {
+            pos[n++] = i;
+        }
+    }
+    return n;
+}
+
+/*
+ * Both compare 64 bytes per step and only build the bitmask when one of them
+ * is a newline, records are usually longer than that.
+ */
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *buf, size_t len, size_t *pos, size_t max) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    __m128i a, b, c, d;
+    uint64_t mask;
+    size_t n = 0;
+    size_t i;
+
+    for (i = 0; i + 64 <= len && n < max; i += 64) {
+        a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), newline);
+        b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 16)), newline);
+        c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 32)), newline);
+        d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 48)), newline);
+        if (!_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)))) {
+            continue;
+        }
+        mask = (uint64_t)(uint16_t)_mm_movemask_epi8(a) |
+               (uint64_t)(uint16_t)_mm_movemask_epi8(b) << 16 |
+               (uint64_t)(uint16_t)_mm_movemask_epi8(c) << 32 |
+               (uint64_t)(uint16_t)_mm_movemask_epi8(d) << 48;
+        n = scan_mask(mask, i, pos, n, max);
+    }
+    return scan_tail(buf, i, len, pos, n, max);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, size_t *pos, size_t max) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    __m256i a, b;
+    uint64_t mask;
+    size_t n = 0;
+    size_t i;
+
+    for (i = 0; i + 64 <= len && n < max; i += 64) {
+        a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), newline);
+        b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 32)), newline);
+        if (_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) {
+            continue;
+        }
+        mask = (uint64_t)(uint32_t)_mm256_movemask_epi8(a) |
+               (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+        n = scan_mask(mask, i, pos, n, max);
+    }
+    return scan_tail(buf, i, len, pos, n, max);
+}
+
+static int has_sse2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static int has_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* Best first */
+static const frame_impl_desc_t impls[] = {
+#ifdef FRAMING_X86
+    { "avx2", scan_avx2, has_avx2 },
+    { "sse2", scan_sse2, has_sse2 },
+#endif
+    { "memchr", scan_memchr, always },
+};
+
+static const frame_impl_desc_t *selected;
+
+static const frame_impl_desc_t* frame_pick(void) {
+    const frame_impl_desc_t *impl = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    size_t i;
+
+    if (impl) {
+        return impl;
+    }
+
+    // Racing threads pick the same one
+    for (i = 0; !impl; i++) {
+        if (impls[i].supported()) {
+            impl = &impls[i];
+        }
+    }
+    __atomic_store_n(&selected, impl, __ATOMIC_RELEASE);
+    return impl;
+}
+
+size_t frame_scan(const char *buf, size_t len, size_t *pos, size_t max) {
+    return frame_pick()->scan(buf, len, pos, max);
+}
+
+int frame_select(const char *name) {
+    size_t i;
+
+    for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (strcmp(impls[i].name, name) == 0 && impls[i].supported()) {
+            __atomic_store_n(&selected, &impls[i], __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char* frame_impl(void) {
+    return frame_pick()->name;
+}
@@ -0,0 +1,29 @@
+#ifndef AESDSOCKET_FRAMING_H
+#define AESDSOCKET_FRAMING_H
+
+#include <stddef.h>
+
+/* Newline positions gathered per scan of the receive buffer */
+#define FRAME_BATCH 64
+
+/**
+ * Finds the newlines in @param buf in one pass, storing the offsets of the
+ * first @param max of them in @param pos in ascending order. Scans 32 or 16
+ * bytes per compare with AVX2 or SSE2 when the CPU has them, memchr()
+ * otherwise.
+ * @return number of offsets stored
+ */
+size_t frame_scan(const char *buf, size_t len, size_t *pos, size_t max);
+
+/**
+ * Forces an implementation: "avx2", "sse2" or "memchr". Meant for benchmarks.
+ * @return 0 on success, -1 when it is unknown or the CPU lacks it
+ */
+int frame_select(const char *name);
+
+/**
+ * @return name of the implementation frame_scan() uses
+ */
+const char* frame_impl(void);
+
+#endif /* AESDSOCKET_FRAMING_H */
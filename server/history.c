@@ -0,0 +1,176 @@
+#include "aesdsocket.h"
+#include "history.h"
+
+int history_cache = 0;
+
+static struct {
+    pthread_mutex_t lock;
+    history_chunk_t *head;      /* referenced */
+    history_chunk_t *tail;
+    size_t start;               /* offset of the oldest byte kept */
+    size_t end;
+    history_snapshot_t *current;
+} history;
+
+static void chunk_get(history_chunk_t *chunk) {
+    __atomic_add_fetch(&chunk->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void chunk_put(history_chunk_t *chunk) {
+    history_chunk_t *next;
+
+    // Iterative, dropping the last reference to a chunk releases its successor too
+    while (chunk && __atomic_sub_fetch(&chunk->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+void history_trim(size_t start) {
+    history_chunk_t *head;
+
+    pthread_mutex_lock(&history.lock);
+
+    if (start > history.start && start <= history.end) {
+        history.start = start;
+    }
+
+    while (history.head != history.tail &&
+           history.head->base + HISTORY_CHUNK_SIZE <= history.start) {
+        head = history.head;
+        history.head = head->next;
+        chunk_get(history.head);
+        chunk_put(head);
+    }
+
+    pthread_mutex_unlock(&history.lock);
+}
+
+static int history_append_locked(const char *data, size_t len) {
+    history_chunk_t *chunk;
+    size_t copy;
+
+    while (len > 0) {
+        if (!history.tail || history.tail->used == HISTORY_CHUNK_SIZE) {
+            chunk = malloc(sizeof(history_chunk_t));
+            if (!chunk) {
+                return -1;
+            }
+            chunk->refcount = 1;    /* owned by the previous chunk, or by the cache */
+            chunk->next = NULL;
+            chunk->base = history.end;
+            chunk->used = 0;
+
+            if (history.tail) {
+                history.tail->next = chunk;
+            } else {
+                history.head = chunk;
+            }
+            history.tail = chunk;
+        }
+
+        chunk = history.tail;
+        copy = HISTORY_CHUNK_SIZE - chunk->used;
+        if (copy > len) {
+            copy = len;
+        }
+
+        memcpy(chunk->data + chunk->used, data, copy);
+        chunk->used += copy;
+        history.end += copy;
+        data += copy;
+        len -= copy;
+    }
+
+    return 0;
+}
+
+int history_init(void) {
+    memset(&history, 0, sizeof(history));
+    pthread_mutex_init(&history.lock, NULL);
+    return 0;
+}
+
+void history_cleanup(void) {
+    if (history.current) {
+        history_snapshot_put(history.current);
+    }
+    chunk_put(history.head);
+    pthread_mutex_destroy(&history.lock);
+    memset(&history, 0, sizeof(history));
+}
+
+int history_append(const char *data, size_t len) {
+    int ret;
+
+    pthread_mutex_lock(&history.lock);
+    ret = history_append_locked(data, len);
+    pthread_mutex_unlock(&history.lock);
+
+    if (ret != 0) {
+        syslog(LOG_ERR, "couldnt grow history cache");
+    }
+    return ret;
+}
+
+history_snapshot_t* history_snapshot_get(void) {
+    history_snapshot_t *snap;
+
+    pthread_mutex_lock(&history.lock);
+
+    snap = history.current;
+    if (!snap || snap->start != history.start || snap->end != history.end) {
+        snap = malloc(sizeof(history_snapshot_t));
+        if (!snap) {
+            pthread_mutex_unlock(&history.lock);
+            return NULL;
+        }
+        snap->refcount = 1;     /* the cache's reference */
+        snap->first = history.head;
+        snap->start = history.start;
+        snap->end = history.end;
+        if (snap->first) {
+            chunk_get(snap->first);
+        }
+
+        if (history.current) {
+            history_snapshot_put(history.current);
+        }
+        history.current = snap;
+    }
+    __atomic_add_fetch(&snap->refcount, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&history.lock);
+
+    return snap;
+}
+
+void history_snapshot_put(history_snapshot_t *snap) {
+    if (__atomic_sub_fetch(&snap->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        chunk_put(snap->first);
+        free(snap);
+    }
+}
+
+size_t history_snapshot_peek(history_snapshot_t *snap, history_chunk_t **chunk, size_t pos, const char **data) {
+    history_chunk_t *curr = *chunk ? *chunk : snap->first;
+    size_t avail;
+
+    if (pos >= snap->end || !curr) {
+        return 0;
+    }
+
+    while (pos >= curr->base + HISTORY_CHUNK_SIZE) {
+        curr = curr->next;
+    }
+    *chunk = curr;
+
+    avail = curr->base + HISTORY_CHUNK_SIZE - pos;
+    if (avail > snap->end - pos) {
+        avail = snap->end - pos;
+    }
+    *data = curr->data + (pos - curr->base);
+
+    return avail;
+}
@@ -0,0 +1,72 @@
+#ifndef AESDSOCKET_HISTORY_H
+#define AESDSOCKET_HISTORY_H
+
+#include <stddef.h>
+
+#define HISTORY_CHUNK_SIZE (64 * 1024)
+
+/**
+ * Fixed size piece of the append-only history buffer. Bytes below used never
+ * change once written, so readers may access them without locking. Each chunk
+ * owns a reference to the next one, so holding a chunk keeps the rest of the
+ * chain alive.
+ */
+typedef struct history_chunk {
+    int refcount;
+    struct history_chunk *next;
+    size_t base;            /* history offset of data[0] */
+    size_t used;
+    char data[HISTORY_CHUNK_SIZE];
+} history_chunk_t;
+
+/**
+ * Immutable view of the history between two offsets, shared by every reply
+ * opened while no record was appended.
+ */
+typedef struct history_snapshot {
+    int refcount;
+    history_chunk_t *first;     /* chunk holding start, referenced */
+    size_t start;
+    size_t end;
+} history_snapshot_t;
+
+/* Set to serve replies from memory instead of rereading the data file */
+extern int history_cache;
+
+/**
+ * Initializes an empty cache, the storage loads it with history_append().
+ * The history only holds bytes, record boundaries are looked up in the
+ * record index (recindex.h), which counts offsets the same way.
+ * @return 0 on success, -1 on failure
+ */
+int history_init(void);
+void history_cleanup(void);
+
+/**
+ * Appends newline terminated records. Callers serialize appends with the
+ * storage writer lock so the cache follows the data file order.
+ */
+int history_append(const char *data, size_t len);
+
+/**
+ * Drops the bytes before history offset @param start, where the oldest
+ * record kept begins, and releases the chunks nobody references anymore.
+ */
+void history_trim(size_t start);
+
+/**
+ * @return a referenced snapshot of the whole history, or NULL on failure
+ */
+history_snapshot_t* history_snapshot_get(void);
+
+void history_snapshot_put(history_snapshot_t *snap);
+
+/**
+ * Points @param data at the contiguous bytes of @param snap starting at
+ * history offset @param pos. @param chunk caches the chunk holding pos between
+ * calls and must start out NULL.
+ * @return number of bytes available at data, 0 at the end of the snapshot
+ */
+size_t history_snapshot_peek(history_snapshot_t *snap, history_chunk_t **chunk, size_t pos, const char **data);
+
+#endif /* AESDSOCKET_HISTORY_H */
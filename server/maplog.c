@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include "aesdsocket.h"
+#include "maplog.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static struct {
+    int fd;
+    char *base;         /* MAPLOG_RESERVE bytes, file extents mapped from the start */
+    size_t mapped;
+    size_t end;         /* bytes of records, the rest of the mapping is preallocated */
+} mlog = { .fd = -1 };
+
+/**
+ * Makes sure the file and the mapping cover at least @param size bytes.
+ */
+static int maplog_reserve(size_t size) {
+    size_t grow;
+    int ret;
+
+    if (size <= mlog.mapped) {
+        return 0;
+    }
+
+    grow = ((size - mlog.mapped + MAPLOG_EXTENT - 1) / MAPLOG_EXTENT) * MAPLOG_EXTENT;
+    if (mlog.mapped + grow > MAPLOG_RESERVE) {
+        syslog(LOG_ERR, "data file would outgrow the mapping reservation");
+        return -1;
+    }
+
+    // Allocate the blocks now so a full disk fails the append instead of a later page fault
+    ret = posix_fallocate(mlog.fd, mlog.mapped, grow);
+    if (ret != 0) {
+        syslog(LOG_ERR, "couldnt preallocate data file: %s", strerror(ret));
+        return -1;
+    }
+
+    if (mmap(mlog.base + mlog.mapped, grow, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | MAP_POPULATE,
+             mlog.fd, mlog.mapped) == MAP_FAILED) {
+        syslog(LOG_ERR, "couldnt map data file: %s", strerror(errno));
+        return -1;
+    }
+    madvise(mlog.base + mlog.mapped, grow, MADV_SEQUENTIAL);
+    mlog.mapped += grow;
+
+    return 0;
+}
+
+int maplog_open(const char *path) {
+    struct stat st;
+
+    mlog.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (mlog.fd == -1) {
+        syslog(LOG_ERR, "couldnt open data file: %s", strerror(errno));
+        return -1;
+    }
+
+    if (fstat(mlog.fd, &st) == -1) {
+        syslog(LOG_ERR, "couldnt stat data file: %s", strerror(errno));
+        close(mlog.fd);
+        mlog.fd = -1;
+        return -1;
+    }
+
+    mlog.base = mmap(NULL, MAPLOG_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mlog.base == MAP_FAILED) {
+        syslog(LOG_ERR, "couldnt reserve address space for the data file");
+        close(mlog.fd);
+        mlog.fd = -1;
+        return -1;
+    }
+
+    mlog.mapped = 0;
+    mlog.end = st.st_size;
+    if (maplog_reserve(mlog.end ? mlog.end : 1) != 0) {
+        maplog_close();
+        return -1;
+    }
+
+    return 0;
+}
+
+void maplog_close(void) {
+    if (mlog.fd == -1) {
+        return;
+    }
+
+    munmap(mlog.base, MAPLOG_RESERVE);
+    if (ftruncate(mlog.fd, mlog.end) == -1) {
+        syslog(LOG_ERR, "couldnt trim data file: %s", strerror(errno));
+    }
+    close(mlog.fd);
+    mlog.fd = -1;
+}
+
+int maplog_append(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (maplog_reserve(mlog.end + len) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(mlog.base + mlog.end, iov[i].iov_base, iov[i].iov_len);
+        mlog.end += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+int maplog_sync(void) {
+    // Writes through the shared mapping dirty the page cache like write() does
+    while (fdatasync(mlog.fd) == -1) {
+        if (errno != EINTR) {
+            syslog(LOG_ERR, "couldnt sync data file: %s", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+const char* maplog_data(void) {
+    return mlog.base;
+}
+
+size_t maplog_end(void) {
+    return mlog.end;
+}
+
+void maplog_willneed(size_t pos, size_t len) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = pos & ~(page - 1);
+
+    madvise(mlog.base + start, pos + len - start, MADV_WILLNEED);
+}
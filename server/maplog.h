@@ -0,0 +1,55 @@
+#ifndef AESDSOCKET_MAPLOG_H
+#define AESDSOCKET_MAPLOG_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define MAPLOG_EXTENT       (64 * 1024 * 1024)
+/* Address space reserved up front so the mapping never moves under readers */
+#define MAPLOG_RESERVE      (sizeof(void *) == 8 ? (size_t)1 << 40 : (size_t)1 << 30)
+
+/**
+ * Maps the data file for appending. The file is grown in MAPLOG_EXTENT steps
+ * with fallocate(), each extent mapped right after the previous one inside a
+ * fixed reservation, so pointers into the log stay valid while it grows.
+ * @return 0 on success, -1 on failure
+ */
+int maplog_open(const char *path);
+
+/**
+ * Trims the preallocated tail off the data file and unmaps it.
+ */
+void maplog_close(void);
+
+/**
+ * Copies the records into the mapping, growing it as needed. Callers
+ * serialize appends with the storage writer lock.
+ * @return 0 on success, -1 on failure
+ */
+int maplog_append(const struct iovec *iov, int iovcnt);
+
+/**
+ * Forces the appended records to disk.
+ * @return 0 on success, -1 on failure
+ */
+int maplog_sync(void);
+
+/**
+ * @return the first byte of the log. Bytes below maplog_end() never change,
+ * so they may be read without locking.
+ */
+const char* maplog_data(void);
+
+/**
+ * @return the length of the log. Call with the writer lock held to get a
+ * length ending on a record boundary.
+ */
+size_t maplog_end(void);
+
+/**
+ * Hints the kernel that [@param pos, @param pos + @param len) of the log is
+ * about to be read.
+ */
+void maplog_willneed(size_t pos, size_t len);
+
+#endif /* AESDSOCKET_MAPLOG_H */
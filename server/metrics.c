@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+#include "aesdsocket.h"
+#include "metrics.h"
+#include "storage.h"
+#include <poll.h>
+#include <time.h>
+#include <sys/un.h>
+
+static histogram_t histograms[HIST_COUNT];
+static uint64_t counters[CTR_COUNT];
+
+static const char *hist_names[HIST_COUNT] = {
+    [HIST_FIRST_BYTE] = "aesdsocket_first_byte_seconds",
+    [HIST_STORE] = "aesdsocket_store_seconds",
+    [HIST_REPLAY] = "aesdsocket_replay_seconds",
+    [HIST_LOCK_WAIT] = "aesdsocket_lock_wait_seconds",
+};
+
+static const struct {
+    const char *name;
+    const char *type;
+} counter_info[CTR_COUNT] = {
+    [CTR_CONNECTIONS] = { "aesdsocket_connections_total", "counter" },
+    [CTR_ACTIVE] = { "aesdsocket_connections_active", "gauge" },
+    [CTR_RECORDS] = { "aesdsocket_records_total", "counter" },
+    [CTR_BYTES_IN] = { "aesdsocket_received_bytes_total", "counter" },
+    [CTR_BYTES_OUT] = { "aesdsocket_sent_bytes_total", "counter" },
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static struct {
+    pthread_t thread_id;
+    int fd;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} server = { .fd = -1 };
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned bucket_index(uint64_t value) {
+    unsigned msb;
+
+    if (value < METRICS_SUB_COUNT) {
+        return value;
+    }
+
+    msb = 63 - __builtin_clzll(value);
+    return (msb - METRICS_SUB_BITS + 1) * METRICS_SUB_COUNT +
+           ((value >> (msb - METRICS_SUB_BITS)) & (METRICS_SUB_COUNT - 1));
+}
+
+/**
+ * @return the middle of the range of values counted by bucket @param index
+ */
+static uint64_t bucket_value(unsigned index) {
+    unsigned shift;
+
+    if (index < METRICS_SUB_COUNT) {
+        return index;
+    }
+
+    shift = index / METRICS_SUB_COUNT - 1;
+    return ((uint64_t)(METRICS_SUB_COUNT + index % METRICS_SUB_COUNT) << shift) + ((1ull << shift) >> 1);
+}
+
+void metrics_record(metrics_hist_t hist, uint64_t ns) {
+    histogram_t *h = &histograms[hist];
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&h->buckets[bucket_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+
+    while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void metrics_record_since(metrics_hist_t hist, uint64_t start) {
+    metrics_record(hist, metrics_now() - start);
+}
+
+void metrics_add(metrics_counter_t counter, int64_t value) {
+    __atomic_add_fetch(&counters[counter], (uint64_t)value, __ATOMIC_RELAXED);
+}
+
+static void format_histogram(FILE *out, metrics_hist_t hist) {
+    histogram_t *h = &histograms[hist];
+    const char *name = hist_names[hist];
+    uint64_t counts[METRICS_BUCKETS];
+    uint64_t total = 0;
+    uint64_t seen = 0;
+    uint64_t value;
+    unsigned q = 0;
+    unsigned i;
+
+    // Buckets keep changing while we read them, quantiles are computed on this copy
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+
+    fprintf(out, "# TYPE %s summary\n", name);
+    for (i = 0; i < METRICS_BUCKETS && q < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        seen += counts[i];
+        while (total > 0 && q < sizeof(quantiles) / sizeof(quantiles[0]) && seen >= quantiles[q] * total) {
+            value = bucket_value(i);
+            if (value > h->max) {
+                value = h->max;
+            }
+            fprintf(out, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[q], value / 1e9);
+            q++;
+        }
+    }
+    for (; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        fprintf(out, "%s{quantile=\"%g\"} NaN\n", name, quantiles[q]);
+    }
+    fprintf(out, "%s_max %.9f\n", name, __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e9);
+    fprintf(out, "%s_sum %.9f\n", name, __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e9);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long)__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+}
+
+char* metrics_format(size_t *len) {
+    storage_stats_t stats;
+    char *buf = NULL;
+    FILE *out;
+    int i;
+
+    out = open_memstream(&buf, len);
+    if (!out) {
+        syslog(LOG_ERR, "couldnt format metrics");
+        return NULL;
+    }
+
+    for (i = 0; i < CTR_COUNT; i++) {
+        fprintf(out, "# TYPE %s %s\n", counter_info[i].name, counter_info[i].type);
+        fprintf(out, "%s %lld\n", counter_info[i].name,
+                (long long)__atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+    }
+    if (storage_stats(&stats) == 0) {
+        fprintf(out, "# TYPE aesdsocket_storage_bytes gauge\n");
+        fprintf(out, "aesdsocket_storage_bytes{backend=\"%s\"} %zu\n", storage_backend_name(), stats.bytes);
+    }
+    for (i = 0; i < HIST_COUNT; i++) {
+        format_histogram(out, i);
+    }
+
+    if (fclose(out) != 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static void metrics_reply(int fd) {
+    size_t len, sent = 0;
+    ssize_t bytes;
+    char *text;
+
+    text = metrics_format(&len);
+    if (!text) {
+        return;
+    }
+
+    while (sent < len) {
+        bytes = send(fd, text + sent, len - sent, MSG_NOSIGNAL);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        sent += bytes;
+    }
+
+    free(text);
+}
+
+static void* metrics_serve(void *arg) {
+    struct pollfd pfds[2];
+    int fd;
+
+    pfds[0].fd = server.fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = shutdown_fd;
+    pfds[1].events = POLLIN;
+
+    while (!close_server) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "metrics poll failed: %s", strerror(errno));
+            break;
+        }
+        if (pfds[1].revents) {
+            break;
+        }
+
+        fd = accept4(server.fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        metrics_reply(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int metrics_serve_start(const char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "metrics socket path too long: %s", path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(server.path, path);
+
+    server.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.fd == -1) {
+        syslog(LOG_ERR, "couldnt create metrics socket");
+        return -1;
+    }
+
+    // A stale socket left behind by a previous run would make bind fail
+    unlink(path);
+    if (bind(server.fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(server.fd, listen_backlog) == -1) {
+        syslog(LOG_ERR, "couldnt listen on metrics socket %s: %s", path, strerror(errno));
+        close(server.fd);
+        server.fd = -1;
+        return -1;
+    }
+
+    if (spawn_worker(&server.thread_id, metrics_serve, NULL) != 0) {
+        syslog(LOG_ERR, "couldnt create metrics thread");
+        close(server.fd);
+        unlink(path);
+        server.fd = -1;
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Serving metrics on %s", path);
+    return 0;
+}
+
+void metrics_serve_stop(void) {
+    if (server.fd == -1) {
+        return;
+    }
+
+    pthread_join(server.thread_id, NULL);
+    close(server.fd);
+    unlink(server.path);
+    server.fd = -1;
+}
@@ -0,0 +1,73 @@
+#ifndef AESDSOCKET_METRICS_H
+#define AESDSOCKET_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram: values below
+ * 2^METRICS_SUB_BITS get a bucket each, above that every power of two is split
+ * into 2^METRICS_SUB_BITS linear buckets, so any recorded value is reported
+ * within ~6% of its true value.
+ */
+#define METRICS_SUB_BITS    4
+#define METRICS_SUB_COUNT   (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS     ((64 - METRICS_SUB_BITS + 1) * METRICS_SUB_COUNT)
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;                       /* nanoseconds */
+    uint64_t max;
+    uint64_t buckets[METRICS_BUCKETS];
+} histogram_t;
+
+typedef enum metrics_hist {
+    HIST_FIRST_BYTE,    /* accept to first byte received */
+    HIST_STORE,         /* appending a record, queued to committed */
+    HIST_REPLAY,        /* reply queued to its last byte sent */
+    HIST_LOCK_WAIT,     /* waiting for the storage writer lock */
+    HIST_COUNT,
+} metrics_hist_t;
+
+typedef enum metrics_counter {
+    CTR_CONNECTIONS,    /* accepted since start */
+    CTR_ACTIVE,         /* open right now */
+    CTR_RECORDS,        /* records appended */
+    CTR_BYTES_IN,
+    CTR_BYTES_OUT,
+    CTR_COUNT,
+} metrics_counter_t;
+
+/**
+ * @return CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t metrics_now(void);
+
+/**
+ * Adds one observation of @param ns nanoseconds. Lock-free, safe from any thread.
+ */
+void metrics_record(metrics_hist_t hist, uint64_t ns);
+
+/**
+ * Records the time elapsed since @param start, as returned by metrics_now().
+ */
+void metrics_record_since(metrics_hist_t hist, uint64_t start);
+
+void metrics_add(metrics_counter_t counter, int64_t value);
+
+/**
+ * Renders every counter and histogram in the Prometheus text exposition
+ * format, latencies as summaries in seconds.
+ * @return malloc'ed text of @param len bytes, NULL on failure
+ */
+char* metrics_format(size_t *len);
+
+/**
+ * Serves metrics_format() to every client connecting to the Unix socket at
+ * @param path from a background thread, until close_server is set.
+ * @return 0 on success, -1 on failure
+ */
+int metrics_serve_start(const char *path);
+void metrics_serve_stop(void);
+
+#endif /* AESDSOCKET_METRICS_H */
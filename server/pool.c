@@ -0,0 +1,212 @@
+#include "aesdsocket.h"
+#include "pool.h"
+#include <time.h>
+
+#define QUEUE_WAIT_NS 200000000L
+
+int work_queue_init(work_queue_t *queue, size_t capacity) {
+    memset(queue, 0, sizeof(work_queue_t));
+
+    queue->items = calloc(capacity, sizeof(connection_t *));
+    if (!queue->items) {
+        return -1;
+    }
+    queue->capacity = capacity;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+
+    return 0;
+}
+
+void work_queue_destroy(work_queue_t *queue) {
+    connection_t *conn;
+
+    while (queue->count > 0) {
+        conn = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        conn_destroy(conn);
+    }
+
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->items);
+}
+
+int work_queue_wait_space(work_queue_t *queue) {
+    struct timespec deadline;
+    int ret = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity && !queue->closed && !close_server) {
+        // Bounded wait, the signal handler can't signal the condition variable
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += QUEUE_WAIT_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&queue->not_full, &queue->lock, &deadline);
+    }
+    if (queue->closed || close_server) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return ret;
+}
+
+int work_queue_push(work_queue_t *queue, connection_t *conn) {
+    int ret = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->closed && queue->count < queue->capacity) {
+        queue->items[(queue->head + queue->count) % queue->capacity] = conn;
+        queue->count++;
+        pthread_cond_signal(&queue->not_empty);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return ret;
+}
+
+connection_t* work_queue_pop(work_queue_t *queue) {
+    connection_t *conn = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count > 0 && !queue->closed) {
+        conn = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return conn;
+}
+
+void work_queue_close(work_queue_t *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void* pool_worker(void *arg) {
+    pool_worker_t *worker = (pool_worker_t *)arg;
+    connection_t *conn;
+
+    while ((conn = work_queue_pop(worker->queue)) != NULL) {
+        pthread_mutex_lock(&worker->lock);
+        worker->current = conn;
+        pthread_mutex_unlock(&worker->lock);
+
+        conn_run(conn);
+
+        pthread_mutex_lock(&worker->lock);
+        worker->current = NULL;
+        pthread_mutex_unlock(&worker->lock);
+
+        conn_destroy(conn);
+    }
+
+    return worker;
+}
+
+void run_pool(int sockfd, int nworkers, size_t queue_size) {
+    struct sockaddr_storage conn_addr;
+    socklen_t conn_len;
+    connection_t *conn;
+    pool_worker_t *workers;
+    work_queue_t queue;
+    sigset_t block, old;
+    int connfd;
+    int started = 0;
+    int i;
+
+    if (work_queue_init(&queue, queue_size) != 0) {
+        syslog(LOG_ERR, "couldnt allocate work queue");
+        return;
+    }
+
+    workers = calloc(nworkers, sizeof(pool_worker_t));
+    if (!workers) {
+        syslog(LOG_ERR, "couldnt allocate workers");
+        work_queue_destroy(&queue);
+        return;
+    }
+
+    // Workers inherit a blocked mask so termination signals interrupt the accept loop
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].queue = &queue;
+        pthread_mutex_init(&workers[i].lock, NULL);
+        if (pthread_create(&workers[i].thread_id, NULL, pool_worker, &workers[i]) != 0) {
+            syslog(LOG_ERR, "couldnt create worker thread");
+            pthread_mutex_destroy(&workers[i].lock);
+            break;
+        }
+        started++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    syslog(LOG_INFO, "Started %d workers with a queue of %zu connections", started, queue_size);
+
+    while (started > 0 && !close_server) {
+        // Backpressure: leave connections in the listen backlog while every slot is taken
+        if (work_queue_wait_space(&queue) != 0) {
+            break;
+        }
+
+        conn_len = sizeof(conn_addr);
+        connfd = accept(sockfd, (struct sockaddr *)&conn_addr, &conn_len);
+        if (connfd == -1) {
+            if (errno != EINTR) {
+                syslog(LOG_ERR, "couldnt accept conn");
+            }
+            continue;
+        }
+
+        conn = conn_create(connfd, (struct sockaddr *)&conn_addr);
+        if (!conn) {
+            close(connfd);
+            continue;
+        }
+
+        if (work_queue_push(&queue, conn) != 0) {
+            conn_destroy(conn);
+        }
+    }
+
+    work_queue_close(&queue);
+
+    // Unblock workers still waiting on their clients
+    for (i = 0; i < started; i++) {
+        pthread_mutex_lock(&workers[i].lock);
+        if (workers[i].current) {
+            shutdown(workers[i].current->fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&workers[i].lock);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread_id, NULL);
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+
+    free(workers);
+    work_queue_destroy(&queue);
+}
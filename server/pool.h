@@ -0,0 +1,54 @@
+#ifndef AESDSOCKET_POOL_H
+#define AESDSOCKET_POOL_H
+
+#include <pthread.h>
+#include "connection.h"
+
+#define DEFAULT_POOL_WORKERS 4
+#define DEFAULT_POOL_QUEUE 64
+
+/**
+ * Bounded multi-producer multi-consumer queue of accepted connections
+ */
+typedef struct work_queue {
+    connection_t **items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} work_queue_t;
+
+typedef struct pool_worker {
+    pthread_t thread_id;
+    work_queue_t *queue;
+    pthread_mutex_t lock;
+    connection_t *current;    /* connection being served, protected by lock */
+} pool_worker_t;
+
+int work_queue_init(work_queue_t *queue, size_t capacity);
+void work_queue_destroy(work_queue_t *queue);
+
+/**
+ * Waits until the queue has room for another connection.
+ * @return 0 when there is room, -1 when the queue was closed or the server is shutting down
+ */
+int work_queue_wait_space(work_queue_t *queue);
+int work_queue_push(work_queue_t *queue, connection_t *conn);
+
+/**
+ * @return the oldest queued connection, or NULL once the queue is closed and drained
+ */
+connection_t* work_queue_pop(work_queue_t *queue);
+void work_queue_close(work_queue_t *queue);
+
+/**
+ * Serves the listening socket with @param nworkers pre-spawned workers fed
+ * through a queue of @param queue_size accepted connections, returning once
+ * close_server is set.
+ */
+void run_pool(int sockfd, int nworkers, size_t queue_size);
+
+#endif /* AESDSOCKET_POOL_H */
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include "aesdsocket.h"
+#include "reactor.h"
+#include <sys/epoll.h>
+
+static int epoll_add(int epfd, int fd, uint32_t events, void *ptr) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ptr;
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void reactor_close(reactor_t *reactor, connection_t *conn) {
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    LIST_REMOVE(conn, entries);
+    conn_destroy(conn);
+}
+
+static void reactor_accept(reactor_t *reactor) {
+    struct sockaddr_storage conn_addr;
+    socklen_t conn_len;
+    connection_t *conn;
+    int connfd;
+
+    while (1) {
+        conn_len = sizeof(conn_addr);
+        connfd = accept4(reactor->listenfd, (struct sockaddr *)&conn_addr, &conn_len, SOCK_NONBLOCK);
+        if (connfd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                syslog(LOG_ERR, "couldnt accept conn");
+            }
+            return;
+        }
+
+        conn = conn_create(connfd, (struct sockaddr *)&conn_addr);
+        if (!conn) {
+            close(connfd);
+            continue;
+        }
+
+        if (epoll_add(reactor->epfd, connfd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, conn) == -1) {
+            syslog(LOG_ERR, "couldnt add conn to epoll: %s", strerror(errno));
+            conn_destroy(conn);
+            continue;
+        }
+        LIST_INSERT_HEAD(&reactor->conns, conn, entries);
+
+        // Edge triggered, the packet may already be waiting
+        if (conn_process(conn) == CONN_DONE) {
+            reactor_close(reactor, conn);
+        }
+    }
+}
+
+/**
+ * Disconnects the clients that haven't read any of their queued output
+ * within drain_timeout.
+ */
+static void reactor_sweep(reactor_t *reactor, time_t now) {
+    connection_t *conn, *tmp;
+
+    LIST_FOREACH_SAFE(conn, &reactor->conns, entries, tmp) {
+        if (conn_out_expired(conn, now)) {
+            syslog(LOG_INFO, "Client %s stopped reading, disconnecting", conn->addr);
+            reactor_close(reactor, conn);
+        }
+    }
+}
+
+static void* reactor_loop(void *arg) {
+    reactor_t *reactor = (reactor_t *)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    connection_t *conn;
+    time_t last_sweep = conn_now();
+    time_t now;
+    int nfds, i;
+
+    while (!close_server) {
+        nfds = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS, REACTOR_SWEEP_MS);
+        if (nfds == -1) {
+            if (errno != EINTR) {
+                syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            if (events[i].data.ptr == &reactor->listenfd) {
+                reactor_accept(reactor);
+            } else if (events[i].data.ptr == &shutdown_fd) {
+                break;
+            } else {
+                conn = events[i].data.ptr;
+                if (conn_process(conn) == CONN_DONE) {
+                    reactor_close(reactor, conn);
+                }
+            }
+        }
+
+        now = conn_now();
+        if (now != last_sweep) {
+            reactor_sweep(reactor, now);
+            last_sweep = now;
+        }
+    }
+
+    while (!LIST_EMPTY(&reactor->conns)) {
+        reactor_close(reactor, LIST_FIRST(&reactor->conns));
+    }
+
+    return reactor;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        syslog(LOG_ERR, "couldnt set listening socket non-blocking");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Opens another listener of the SO_REUSEPORT group bound to PORT.
+ */
+static int reactor_listen(void) {
+    int fd;
+
+    fd = create_bind_socket(1);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (listen(fd, listen_backlog) == -1 || set_nonblocking(fd) == -1) {
+        syslog(LOG_ERR, "couldnt listen to socket");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void reactor_pin(reactor_t *reactor, int index) {
+    cpu_set_t cpus;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpus <= 0) {
+        return;
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(index % ncpus, &cpus);
+    if (pthread_setaffinity_np(reactor->thread_id, sizeof(cpus), &cpus) != 0) {
+        syslog(LOG_WARNING, "couldnt pin event loop %d to a core", index);
+    }
+}
+
+void run_reactor(int sockfd, int nthreads, int reuseport) {
+    reactor_t *reactors;
+    uint32_t listen_events = reuseport ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+    int started = 0;
+    int i;
+
+    if (set_nonblocking(sockfd) == -1) {
+        return;
+    }
+
+    reactors = calloc(nthreads, sizeof(reactor_t));
+    if (!reactors) {
+        syslog(LOG_ERR, "couldnt allocate event loops");
+        return;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        reactor_t *reactor = &reactors[i];
+
+        LIST_INIT(&reactor->conns);
+        reactor->listenfd = (reuseport && i > 0) ? reactor_listen() : sockfd;
+        if (reactor->listenfd == -1) {
+            break;
+        }
+        reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactor->epfd == -1) {
+            syslog(LOG_ERR, "couldnt create epoll instance");
+            break;
+        }
+
+        // Without SO_REUSEPORT every loop watches the same listener, EPOLLEXCLUSIVE wakes only one per connection
+        if (epoll_add(reactor->epfd, reactor->listenfd, listen_events, &reactor->listenfd) == -1 ||
+            epoll_add(reactor->epfd, shutdown_fd, EPOLLIN, &shutdown_fd) == -1) {
+            syslog(LOG_ERR, "couldnt register with epoll: %s", strerror(errno));
+            close(reactor->epfd);
+            break;
+        }
+
+        if (pthread_create(&reactor->thread_id, NULL, reactor_loop, reactor) != 0) {
+            syslog(LOG_ERR, "couldnt create event loop thread");
+            close(reactor->epfd);
+            break;
+        }
+        if (reuseport) {
+            reactor_pin(reactor, i);
+        }
+        started++;
+    }
+
+    // A listener opened for a loop that couldn't start
+    if (i < nthreads && reactors[i].listenfd != sockfd && reactors[i].listenfd != -1) {
+        close(reactors[i].listenfd);
+    }
+
+    syslog(LOG_INFO, "Started %d epoll event loops%s", started, reuseport ? " with SO_REUSEPORT listeners" : "");
+
+    for (i = 0; i < started; i++) {
+        pthread_join(reactors[i].thread_id, NULL);
+        close(reactors[i].epfd);
+        if (reactors[i].listenfd != sockfd) {
+            close(reactors[i].listenfd);
+        }
+    }
+
+    free(reactors);
+}
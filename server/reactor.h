@@ -0,0 +1,25 @@
+#ifndef AESDSOCKET_REACTOR_H
+#define AESDSOCKET_REACTOR_H
+
+#include <pthread.h>
+#include "connection.h"
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_SWEEP_MS 1000     /* how often stalled connections are looked for */
+
+typedef struct reactor {
+    pthread_t thread_id;
+    int epfd;
+    int listenfd;
+    LIST_HEAD(conn_list, connection) conns;
+} reactor_t;
+
+/**
+ * Serves the listening socket with @param nthreads edge-triggered epoll event
+ * loops, returning once close_server is set. With @param reuseport every loop
+ * after the first opens its own SO_REUSEPORT listener on the same port and
+ * is pinned to a core, so accepts are spread by the kernel instead of shared.
+ */
+void run_reactor(int sockfd, int nthreads, int reuseport);
+
+#endif /* AESDSOCKET_REACTOR_H */
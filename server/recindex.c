@@ -0,0 +1,124 @@
+#include "aesdsocket.h"
+#include "recindex.h"
+#include "framing.h"
+
+static struct {
+    size_t *starts;         /* start offsets of the records kept, since the first ever indexed */
+    size_t first;           /* index of the oldest record in starts */
+    size_t count;
+    size_t cap;
+    size_t max_records;
+    uint64_t evicted;       /* records dropped from the front, their sequence numbers came first */
+    size_t end;             /* offset right after the last record */
+    size_t open;            /* bytes of a loaded record still missing its newline */
+} idx;
+
+static int recindex_push(size_t len) {
+    size_t *starts;
+    size_t cap;
+
+    if (idx.first > 0 && idx.first + idx.count == idx.cap) {
+        memmove(idx.starts, idx.starts + idx.first, idx.count * sizeof(size_t));
+        idx.first = 0;
+    }
+
+    if (idx.first + idx.count == idx.cap) {
+        cap = idx.cap ? idx.cap * 2 : 64;
+        starts = realloc(idx.starts, cap * sizeof(size_t));
+        if (!starts) {
+            syslog(LOG_ERR, "couldnt grow record index to %zu records", cap);
+            return -1;
+        }
+        idx.starts = starts;
+        idx.cap = cap;
+    }
+
+    idx.starts[idx.first + idx.count++] = idx.end;
+    idx.end += len;
+
+    // Same eviction as the driver's ring, the oldest record goes first
+    if (idx.max_records > 0 && idx.count > idx.max_records) {
+        idx.evicted += idx.count - idx.max_records;
+        idx.first += idx.count - idx.max_records;
+        idx.count = idx.max_records;
+    }
+    return 0;
+}
+
+int recindex_init(size_t max_records) {
+    memset(&idx, 0, sizeof(idx));
+    idx.max_records = max_records;
+    return 0;
+}
+
+void recindex_cleanup(void) {
+    free(idx.starts);
+    memset(&idx, 0, sizeof(idx));
+}
+
+int recindex_load(const char *data, size_t len) {
+    size_t newlines[FRAME_BATCH];
+    size_t scanned = 0;
+    size_t count, i, prev;
+
+    while ((count = frame_scan(data + scanned, len - scanned, newlines, FRAME_BATCH)) > 0) {
+        prev = 0;
+        for (i = 0; i < count; i++) {
+            if (recindex_push(idx.open + newlines[i] + 1 - prev) != 0) {
+                return -1;
+            }
+            idx.open = 0;
+            prev = newlines[i] + 1;
+        }
+        scanned += prev;
+    }
+    idx.open += len - scanned;
+
+    return 0;
+}
+
+int recindex_add(size_t len) {
+    // A torn record loaded at startup ends where the next one starts
+    if (idx.open > 0) {
+        if (recindex_push(idx.open) != 0) {
+            return -1;
+        }
+        idx.open = 0;
+    }
+    return recindex_push(len);
+}
+
+size_t recindex_start(void) {
+    return idx.count ? idx.starts[idx.first] : idx.end;
+}
+
+size_t recindex_count(void) {
+    return idx.count;
+}
+
+uint64_t recindex_head(void) {
+    return idx.evicted + idx.count;
+}
+
+size_t recindex_after(uint64_t seq) {
+    if (seq <= idx.evicted) {
+        return 0;
+    }
+    return seq - idx.evicted < idx.count ? seq - idx.evicted : idx.count;
+}
+
+void recindex_range(size_t first, size_t count, size_t *offset, size_t *len) {
+    const size_t *starts = idx.starts + idx.first;
+    size_t base = idx.count ? starts[0] : idx.end;
+    size_t last;
+
+    if (first >= idx.count || count == 0) {
+        *offset = idx.end - base;
+        *len = 0;
+        return;
+    }
+
+    last = count < idx.count - first ? first + count : idx.count;
+    *offset = starts[first] - base;
+    *len = (last < idx.count ? starts[last] : idx.end) - starts[first];
+}
@@ -0,0 +1,69 @@
+#ifndef AESDSOCKET_RECINDEX_H
+#define AESDSOCKET_RECINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Byte offsets of the records the backend keeps, so a run of records can be
+ * replied without reading the ones before it. Offsets are relative to the
+ * oldest record kept, as backend replays are. Records are also numbered
+ * from 1 in the order they were indexed, evicted ones included, so clients
+ * can ask for what's newer than the last one they saw. The history cache
+ * keeps no boundaries of its own and is trimmed along with the index. Callers
+ * hold the storage writer lock.
+ */
+
+/**
+ * @param max_records how many records the backend keeps, oldest first out,
+ * 0 for no limit
+ * @return 0 on success, -1 on failure
+ */
+int recindex_init(size_t max_records);
+void recindex_cleanup(void);
+
+/**
+ * Indexes bytes replayed from the backend at startup. A record may be split
+ * across calls, a final one without newline counts once recindex_add() or
+ * the next call closes it.
+ * @return 0 on success, -1 on failure
+ */
+int recindex_load(const char *data, size_t len);
+
+/**
+ * Indexes one appended newline terminated record of @param len bytes.
+ * @return 0 on success, -1 on failure
+ */
+int recindex_add(size_t len);
+
+/**
+ * @return offset of the oldest record kept counted from the first byte ever
+ * indexed, the history offset where it starts
+ */
+size_t recindex_start(void);
+
+/**
+ * @return number of records kept
+ */
+size_t recindex_count(void);
+
+/**
+ * @return sequence number of the newest record, 0 before the first one
+ */
+uint64_t recindex_head(void);
+
+/**
+ * @return position among the records kept of the first one newer than
+ * @param seq, recindex_count() when there is none
+ */
+size_t recindex_after(uint64_t seq);
+
+/**
+ * Finds the bytes of records [@param first, @param first + @param count),
+ * clipped to the records kept.
+ * @param offset set to the offset of the first byte
+ * @param len set to the length of the run, 0 when no record is in range
+ */
+void recindex_range(size_t first, size_t count, size_t *offset, size_t *len);
+
+#endif /* AESDSOCKET_RECINDEX_H */
@@ -0,0 +1,755 @@
+#define _GNU_SOURCE
+#include "aesdsocket.h"
+#include "storage.h"
+#include "history.h"
+#include "metrics.h"
+#include "backend.h"
+#include "recindex.h"
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
+
+int commit_max_batch = DEFAULT_COMMIT_MAX_BATCH;
+int commit_linger_us = 0;
+const char *storage_path = NULL;
+int storage_persistent = 0;
+durability_t storage_durability = DURABILITY_NONE;
+int sync_interval_ms = DEFAULT_SYNC_INTERVAL_MS;
+
+static const storage_backend_t *backends[] = {
+    &char_backend,
+    &file_backend,
+    &mmap_backend,
+    &memory_backend,
+};
+
+static const storage_backend_t *backend = &char_backend;
+
+/**
+ * A producer waiting for its record to be committed, lives on its stack
+ */
+typedef struct commit_req {
+    const char *data;
+    size_t len;
+    int ret;
+    int done;
+    STAILQ_ENTRY(commit_req) entries;
+} commit_req_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;        /* a batch landed or the leader stepped down */
+    pthread_cond_t more;        /* wakes a lingering leader once the batch is full */
+    STAILQ_HEAD(commit_queue, commit_req) queue;
+    size_t queued;
+    int leader;                 /* a producer is gathering or writing a batch */
+    int opened;                 /* the backend is open */
+    int dirty;                  /* records written since the last periodic sync */
+    pthread_t syncer;
+    int syncer_running;
+} commit;
+
+static void reply_init(storage_reply_t *reply) {
+    reply->fd = -1;
+    reply->remaining = 0;
+    reply->snap = NULL;
+    reply->map = NULL;
+    reply->chunk = NULL;
+    reply->pos = 0;
+}
+
+int storage_reply_snapshot(storage_reply_t *reply, long record, size_t offset) {
+    history_snapshot_t *snap = history_snapshot_get();
+    size_t pos, start, len;
+
+    if (!snap) {
+        syslog(LOG_ERR, "couldnt snapshot history");
+        return -1;
+    }
+
+    pos = offset < snap->end - snap->start ? snap->start + offset : snap->end;
+    if (record != -1) {
+        // Called with the writer lock held, the index describes the same records as the snapshot
+        recindex_range(record, 1, &start, &len);
+        if (offset >= len) {
+            syslog(LOG_ERR, "seek command out of range");
+            history_snapshot_put(snap);
+            return -1;
+        }
+        pos = snap->start + start + offset;
+    }
+
+    reply->snap = snap;
+    reply->pos = pos;
+    reply->remaining = snap->end - pos;
+    return 0;
+}
+
+/**
+ * Must be called with the writer lock held so the snapshot ends on a record
+ * boundary. On the char device this also pins the reply against records
+ * appended later, though not against the driver evicting old ones.
+ */
+int storage_reply_fd(int fd, storage_reply_t *reply) {
+    off_t pos, end;
+
+    pos = lseek(fd, 0, SEEK_CUR);
+    end = lseek(fd, 0, SEEK_END);
+    if (pos == -1 || end == -1 || lseek(fd, pos, SEEK_SET) == -1) {
+        syslog(LOG_ERR, "couldnt snapshot history length: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    reply->fd = fd;
+    reply->remaining = end > pos ? end - pos : 0;
+    return 0;
+}
+
+/**
+ * Opens a reply on @param len bytes from byte @param offset of the oldest
+ * record kept. Called with the writer lock held.
+ */
+static int open_reply_at_locked(size_t offset, size_t len, storage_reply_t *reply) {
+    int ret;
+
+    if (history_cache) {
+        ret = storage_reply_snapshot(reply, -1, offset);
+    } else {
+        ret = backend->replay(offset, reply);
+    }
+    if (ret == 0 && reply->remaining > len) {
+        reply->remaining = len;
+    }
+    return ret;
+}
+
+static int open_reply_locked(storage_reply_t *reply) {
+    return open_reply_at_locked(0, SIZE_MAX, reply);
+}
+
+/**
+ * Takes the writer lock, recording how long it had to be waited for.
+ * @return 0 on success, -1 on failure
+ */
+static int storage_lock(void) {
+    uint64_t start;
+    int ret;
+
+    // Uncontended, don't pay for reading the clock
+    if (pthread_mutex_trylock(&mutex) == 0) {
+        metrics_record(HIST_LOCK_WAIT, 0);
+        return 0;
+    }
+
+    start = metrics_now();
+    ret = pthread_mutex_lock(&mutex);
+    if (ret != 0) {
+        syslog(LOG_ERR, "lock failed with err %d", ret);
+        return -1;
+    }
+    metrics_record_since(HIST_LOCK_WAIT, start);
+
+    return 0;
+}
+
+int storage_writev(int fd, struct iovec *iov, int iovcnt, size_t *torn) {
+    ssize_t written;
+    int done = 0;
+
+    *torn = 0;
+    while (done < iovcnt) {
+        written = writev(fd, iov + done, iovcnt - done);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "couldnt write records: %s", strerror(errno));
+            return done;
+        }
+
+        while (done < iovcnt && (size_t)written >= iov[done].iov_len) {
+            written -= iov[done].iov_len;
+            done++;
+            *torn = 0;
+        }
+        if (done < iovcnt) {
+            iov[done].iov_base = (char *)iov[done].iov_base + written;
+            iov[done].iov_len -= written;
+            *torn += written;
+        }
+    }
+
+    return done;
+}
+
+/**
+ * Forces the records written so far to disk. Only meaningful for the file
+ * backends, the others keep their records in memory.
+ * @return 0 on success, -1 on failure
+ */
+static int commit_sync(void) {
+    return backend->sync ? backend->sync() : 0;
+}
+
+static void* commit_syncer(void *arg) {
+    struct pollfd pfd;
+
+    pfd.fd = shutdown_fd;
+    pfd.events = POLLIN;
+
+    while (!close_server) {
+        if (poll(&pfd, 1, sync_interval_ms) > 0) {
+            break;
+        }
+        if (__atomic_exchange_n(&commit.dirty, 0, __ATOMIC_RELAXED)) {
+            commit_sync();
+        }
+    }
+
+    return NULL;
+}
+
+static int commit_syncer_start(void) {
+    if (spawn_worker(&commit.syncer, commit_syncer, NULL) != 0) {
+        syslog(LOG_ERR, "couldnt create sync thread");
+        return -1;
+    }
+    commit.syncer_running = 1;
+    return 0;
+}
+
+/**
+ * Takes up to commit_max_batch records off the queue, writes them to the data
+ * file and the history cache under the writer lock and acknowledges them.
+ * When the backend fails partway, the records it stored are still indexed and
+ * acknowledged, only the rest fail.
+ * Called by the leader with commit.lock held, which is dropped meanwhile.
+ */
+static void commit_batch(void) {
+    commit_req_t *batch[COMMIT_MAX_BATCH_LIMIT];
+    struct iovec iov[COMMIT_MAX_BATCH_LIMIT];
+    commit_req_t *req;
+    int count = 0;
+    int stored = 0;
+    int i;
+
+    while (count < commit_max_batch && (req = STAILQ_FIRST(&commit.queue)) != NULL) {
+        STAILQ_REMOVE_HEAD(&commit.queue, entries);
+        commit.queued--;
+        batch[count] = req;
+        iov[count].iov_base = (void *)req->data;
+        iov[count].iov_len = req->len;
+        count++;
+    }
+    pthread_mutex_unlock(&commit.lock);
+
+    if (storage_lock() == 0) {
+        stored = backend->append(iov, count);
+        // Index the records that made it even when the rest failed, the offsets of later ones depend on it
+        for (i = 0; i < stored; i++) {
+            if (recindex_add(batch[i]->len) != 0 ||
+                (history_cache && history_append(batch[i]->data, batch[i]->len) != 0)) {
+                stored = i;
+                break;
+            }
+        }
+        if (history_cache) {
+            history_trim(recindex_start());
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // The next batch can't start before this one is acknowledged, so it grows while we sync
+    if (stored > 0 && storage_durability == DURABILITY_BATCH) {
+        if (commit_sync() != 0) {
+            stored = 0;
+        }
+    } else if (stored > 0) {
+        __atomic_store_n(&commit.dirty, 1, __ATOMIC_RELAXED);
+    }
+    metrics_add(CTR_RECORDS, stored);
+
+    pthread_mutex_lock(&commit.lock);
+    for (i = 0; i < count; i++) {
+        batch[i]->ret = i < stored ? 0 : -1;
+        batch[i]->done = 1;
+    }
+    pthread_cond_broadcast(&commit.done);
+}
+
+/**
+ * Appends one record through the group commit stage. Records queued while a
+ * batch is being written go out together in the next one; whoever finds no
+ * batch in progress leads it, optionally lingering for commit_linger_us to
+ * let it fill up. Returns once the record is in the backend.
+ * @return 0 on success, -1 on failure
+ */
+static int commit_append(const char *record, size_t len) {
+    commit_req_t req = { .data = record, .len = len, .ret = 0, .done = 0 };
+    uint64_t began = metrics_now();
+    struct timespec deadline;
+
+    pthread_mutex_lock(&commit.lock);
+
+    STAILQ_INSERT_TAIL(&commit.queue, &req, entries);
+    commit.queued++;
+    if (commit.leader && commit.queued >= (size_t)commit_max_batch) {
+        pthread_cond_signal(&commit.more);
+    }
+
+    while (!req.done && commit.leader) {
+        pthread_cond_wait(&commit.done, &commit.lock);
+    }
+
+    if (!req.done) {
+        commit.leader = 1;
+
+        if (commit_linger_us > 0 && commit.queued < (size_t)commit_max_batch) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)commit_linger_us * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while (commit.queued < (size_t)commit_max_batch &&
+                   pthread_cond_timedwait(&commit.more, &commit.lock, &deadline) == 0);
+        }
+
+        // Records queued ahead of ours may fill more than one batch
+        while (!req.done) {
+            commit_batch();
+        }
+
+        commit.leader = 0;
+        pthread_cond_broadcast(&commit.done);
+    }
+
+    pthread_mutex_unlock(&commit.lock);
+
+    metrics_record_since(HIST_STORE, began);
+    return req.ret;
+}
+
+int storage_append(const char *record, size_t len) {
+    return commit_append(record, len);
+}
+
+int storage_store(const char *record, size_t len, storage_reply_t *reply) {
+    int ret;
+
+    reply_init(reply);
+
+    if (commit_append(record, len) != 0) {
+        return -1;
+    }
+
+    // Records committed in the same batch after ours may be replayed too
+    if (storage_lock() != 0) {
+        return -1;
+    }
+    ret = open_reply_locked(reply);
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+int storage_open_reply(storage_reply_t *reply) {
+    int ret;
+
+    reply_init(reply);
+
+    if (storage_lock() != 0) {
+        return -1;
+    }
+
+    ret = open_reply_locked(reply);
+
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+int storage_seek(size_t record, size_t offset, storage_reply_t *reply) {
+    int ret;
+
+    reply_init(reply);
+
+    if (storage_lock() != 0) {
+        return -1;
+    }
+
+    if (history_cache) {
+        ret = storage_reply_snapshot(reply, record, offset);
+    } else {
+        ret = backend->seek(record, offset, reply);
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+int storage_open_range(size_t first, size_t count, storage_reply_t *reply) {
+    size_t offset, len;
+    int ret;
+
+    reply_init(reply);
+
+    if (storage_lock() != 0) {
+        return -1;
+    }
+
+    recindex_range(first, count, &offset, &len);
+    ret = open_reply_at_locked(offset, len, reply);
+
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+int storage_open_tail(size_t count, storage_reply_t *reply) {
+    size_t offset, len, total;
+    int ret;
+
+    reply_init(reply);
+
+    if (storage_lock() != 0) {
+        return -1;
+    }
+
+    total = recindex_count();
+    recindex_range(count < total ? total - count : 0, count, &offset, &len);
+    ret = open_reply_at_locked(offset, len, reply);
+
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+int storage_open_since(uint64_t seq, storage_reply_t *reply, uint64_t *head) {
+    size_t offset, len;
+    int ret;
+
+    reply_init(reply);
+
+    if (storage_lock() != 0) {
+        return -1;
+    }
+
+    recindex_range(recindex_after(seq), SIZE_MAX, &offset, &len);
+    *head = recindex_head();
+    ret = open_reply_at_locked(offset, len, reply);
+
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+void storage_close_reply(storage_reply_t *reply) {
+    if (reply->fd != -1) {
+        close(reply->fd);
+    }
+    if (reply->snap) {
+        history_snapshot_put(reply->snap);
+    }
+    reply_init(reply);
+}
+
+int storage_reply_open(storage_reply_t *reply) {
+    return reply->fd != -1 || reply->snap != NULL || reply->map != NULL;
+}
+
+int storage_reply_cached(storage_reply_t *reply) {
+    return reply->snap != NULL || reply->map != NULL;
+}
+
+int storage_reply_iov(storage_reply_t *reply, struct iovec *iov, int max) {
+    history_chunk_t *chunk = reply->chunk;
+    size_t pos = reply->pos;
+    size_t end = reply->pos + reply->remaining;
+    const char *data;
+    size_t avail;
+    int n = 0;
+
+    if (reply->map) {
+        if (max == 0 || reply->remaining == 0) {
+            return 0;
+        }
+        iov[0].iov_base = (void *)(reply->map + reply->pos);
+        iov[0].iov_len = reply->remaining;
+        return 1;
+    }
+
+    while (n < max && pos < end) {
+        avail = history_snapshot_peek(reply->snap, &chunk, pos, &data);
+        if (avail == 0) {
+            break;
+        }
+        if (avail > end - pos) {
+            avail = end - pos;
+        }
+        iov[n].iov_base = (void *)data;
+        iov[n].iov_len = avail;
+        pos += avail;
+        n++;
+    }
+
+    return n;
+}
+
+void storage_reply_consume(storage_reply_t *reply, size_t len) {
+    reply->pos += len;
+    reply->remaining -= len;
+}
+
+static ssize_t read_cached(storage_reply_t *reply, char *buf, size_t len) {
+    const char *data;
+    size_t copied = 0;
+    size_t avail;
+
+    while (copied < len) {
+        avail = history_snapshot_peek(reply->snap, &reply->chunk, reply->pos, &data);
+        if (avail == 0) {
+            break;
+        }
+        if (avail > len - copied) {
+            avail = len - copied;
+        }
+        memcpy(buf + copied, data, avail);
+        copied += avail;
+        reply->pos += avail;
+    }
+    reply->remaining -= copied;
+
+    return copied;
+}
+
+ssize_t storage_read(storage_reply_t *reply, char *buf, size_t len) {
+    ssize_t bytes_read;
+
+    if (len > reply->remaining) {
+        len = reply->remaining;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    if (reply->snap) {
+        return read_cached(reply, buf, len);
+    }
+
+    if (reply->map) {
+        memcpy(buf, reply->map + reply->pos, len);
+        storage_reply_consume(reply, len);
+        return len;
+    }
+
+    do {
+        bytes_read = read(reply->fd, buf, len);
+    } while (bytes_read == -1 && errno == EINTR);
+
+    if (bytes_read > 0) {
+        reply->remaining -= bytes_read;
+    }
+
+    return bytes_read;
+}
+
+/**
+ * Moves the reply through a pipe, for data sendfile() can't read.
+ */
+static ssize_t transfer_splice(storage_reply_t *reply, int sockfd, int pipefd[2], size_t *pipe_len, size_t len) {
+    ssize_t bytes;
+
+    if (*pipe_len == 0) {
+        if (len == 0) {
+            return 0;
+        }
+        if (pipefd[0] == -1 && pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) == -1) {
+            return -1;
+        }
+
+        do {
+            bytes = splice(reply->fd, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while (bytes == -1 && errno == EINTR);
+
+        if (bytes <= 0) {
+            return bytes;
+        }
+        reply->remaining -= bytes;
+        *pipe_len = bytes;
+    }
+
+    bytes = splice(pipefd[0], NULL, sockfd, NULL, *pipe_len, SPLICE_F_MOVE);
+    if (bytes > 0) {
+        *pipe_len -= bytes;
+    }
+
+    return bytes;
+}
+
+ssize_t storage_transfer(storage_reply_t *reply, int sockfd, int pipefd[2], size_t *pipe_len) {
+    ssize_t bytes;
+    size_t len = reply->remaining < REPLY_CHUNK ? reply->remaining : REPLY_CHUNK;
+    const char *data;
+
+    if (reply->snap) {
+        // Already in memory, send straight from the shared snapshot
+        len = history_snapshot_peek(reply->snap, &reply->chunk, reply->pos, &data);
+        if (len == 0) {
+            return 0;
+        }
+        bytes = send(sockfd, data, len, MSG_NOSIGNAL);
+        if (bytes > 0) {
+            reply->pos += bytes;
+            reply->remaining -= bytes;
+        }
+        return bytes;
+    }
+
+    if (reply->map) {
+        // Mapped pages, send them without a read into a bounce buffer
+        if (len == 0) {
+            return 0;
+        }
+        bytes = send(sockfd, reply->map + reply->pos, len, MSG_NOSIGNAL);
+        if (bytes > 0) {
+            storage_reply_consume(reply, bytes);
+        }
+        return bytes;
+    }
+
+    if (backend->splice) {
+        return transfer_splice(reply, sockfd, pipefd, pipe_len, len);
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+    bytes = sendfile(sockfd, reply->fd, NULL, len);
+    if (bytes > 0) {
+        reply->remaining -= bytes;
+    }
+
+    return bytes;
+}
+
+int storage_select(const char *name) {
+    size_t i;
+
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            backend = backends[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char* storage_backend_name(void) {
+    return backend->name;
+}
+
+int storage_timestamps(void) {
+    return backend->timestamps;
+}
+
+int storage_stats(storage_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    return backend->stats(stats);
+}
+
+/**
+ * Fills the record index, and the history cache when enabled, with a replay
+ * of the backend, which ends with the last record even where the data file
+ * is preallocated past it. Both keep as many records as the backend, the
+ * driver only has its ring of the most recent writes.
+ * @return 0 on success, -1 on failure
+ */
+static int storage_load(void) {
+    storage_reply_t reply;
+    char buffer[4096];
+    ssize_t bytes_read;
+    size_t loaded = 0;
+    int ret = 0;
+
+    reply_init(&reply);
+    if (backend->replay(0, &reply) != 0) {
+        return -1;
+    }
+
+    while ((bytes_read = storage_read(&reply, buffer, sizeof(buffer))) != 0) {
+        if (bytes_read == -1) {
+            syslog(LOG_ERR, "couldnt load history: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (recindex_load(buffer, bytes_read) != 0 ||
+            (history_cache && history_append(buffer, bytes_read) != 0)) {
+            ret = -1;
+            break;
+        }
+        if (history_cache) {
+            history_trim(recindex_start());
+        }
+        loaded += bytes_read;
+    }
+
+    storage_close_reply(&reply);
+    if (ret == 0) {
+        syslog(LOG_INFO, "Loaded %zu bytes of history in %zu records", loaded, recindex_count());
+    }
+    return ret;
+}
+
+int storage_init(void) {
+    const char *path = storage_path ? storage_path : backend->path;
+    size_t max_records;
+
+    pthread_mutex_init(&commit.lock, NULL);
+    pthread_cond_init(&commit.done, NULL);
+    pthread_cond_init(&commit.more, NULL);
+    STAILQ_INIT(&commit.queue);
+
+    if (backend->open(path) != 0) {
+        return -1;
+    }
+    commit.opened = 1;
+
+    if (storage_durability == DURABILITY_PERIODIC && backend->sync && commit_syncer_start() != 0) {
+        return -1;
+    }
+
+    // Nothing to mirror, the memory backend is the history
+    if (!backend->path) {
+        history_cache = 0;
+    }
+
+    max_records = backend->capacity ? backend->capacity() : backend->max_records;
+    if (recindex_init(max_records) != 0 || (history_cache && history_init() != 0)) {
+        return -1;
+    }
+    return storage_load();
+}
+
+void storage_cleanup(void) {
+    if (commit.syncer_running) {
+        pthread_join(commit.syncer, NULL);
+        commit.syncer_running = 0;
+    }
+
+    if (commit.opened) {
+        if (storage_durability != DURABILITY_NONE) {
+            commit_sync();
+        }
+        backend->close();
+        commit.opened = 0;
+    }
+    pthread_cond_destroy(&commit.more);
+    pthread_cond_destroy(&commit.done);
+    pthread_mutex_destroy(&commit.lock);
+
+    if (history_cache) {
+        history_cleanup();
+    }
+    recindex_cleanup();
+}
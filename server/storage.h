@@ -0,0 +1,179 @@
+#ifndef AESDSOCKET_STORAGE_H
+#define AESDSOCKET_STORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "history.h"
+
+#define REPLY_CHUNK         65536
+
+#define DEFAULT_COMMIT_MAX_BATCH    64
+#define COMMIT_MAX_BATCH_LIMIT      1024    /* IOV_MAX */
+
+#define DEFAULT_SYNC_INTERVAL_MS    1000
+
+typedef enum durability {
+    DURABILITY_NONE,        /* leave writing back to the kernel */
+    DURABILITY_PERIODIC,    /* fdatasync() every sync_interval_ms when records were added */
+    DURABILITY_BATCH,       /* fdatasync() before acknowledging each group commit */
+} durability_t;
+
+/* Data path overriding the default of the backend, NULL to use the default */
+extern const char *storage_path;
+/* Keep the data file when the server exits */
+extern int storage_persistent;
+/* When appended records are forced to disk, file backends only */
+extern durability_t storage_durability;
+extern int sync_interval_ms;
+
+/* Most records written by one group commit writev() */
+extern int commit_max_batch;
+/* Microseconds a batch waits for more records before it is written, 0 for none */
+extern int commit_linger_us;
+
+/**
+ * A reply streamed from the stored history. The length is snapshotted under
+ * the writer lock when the reply is opened, so it always ends on a record
+ * boundary and can be streamed without holding the lock while appends go on.
+ */
+typedef struct storage_reply {
+    int fd;             /* data file reply, -1 when not replying from the file */
+    size_t remaining;   /* bytes of the snapshot still to send */
+    history_snapshot_t *snap;   /* in-memory reply when the history cache is on */
+    const char *map;            /* reply from the mapped data file */
+    history_chunk_t *chunk;
+    size_t pos;
+} storage_reply_t;
+
+typedef struct storage_stats {
+    size_t bytes;       /* history held by the backend */
+} storage_stats_t;
+
+/**
+ * Selects the backend keeping the records: "char" for the aesdchar device
+ * (the default), "file" for a plain data file, "mmap" for the data file
+ * appended through a memory mapping or "memory" for the process memory only.
+ * @return 0 on success, -1 for an unknown backend
+ */
+int storage_select(const char *name);
+const char* storage_backend_name(void);
+
+/**
+ * @return nonzero when the selected backend takes timestamp records by default
+ */
+int storage_timestamps(void);
+
+/**
+ * Opens the selected backend for appending and loads the history cache from
+ * it when the cache is enabled. The file backends truncate a torn record left
+ * at the end of the data file by a crash first.
+ * @return 0 on success, -1 on failure
+ */
+int storage_init(void);
+void storage_cleanup(void);
+
+/**
+ * Fills @param stats from the backend. Doesn't take the writer lock.
+ * @return 0 on success, -1 on failure
+ */
+int storage_stats(storage_stats_t *stats);
+
+/**
+ * Appends one newline terminated record to the backend. Concurrent appends
+ * are group committed, the call returns once the batch holding the record
+ * has been written.
+ * @return 0 on success, -1 on failure
+ */
+int storage_append(const char *record, size_t len);
+
+/**
+ * Stores one newline terminated record and opens the reply to send back, the
+ * history as it was right after the batch holding the record was committed.
+ * @return 0 on success, -1 on failure
+ */
+int storage_store(const char *record, size_t len, storage_reply_t *reply);
+
+/**
+ * Opens a reply replaying the whole history.
+ * @return 0 on success, -1 on failure
+ */
+int storage_open_reply(storage_reply_t *reply);
+
+/**
+ * Opens a reply from byte @param offset of record @param record, counting
+ * from the oldest record kept, to the end of the history.
+ * @return 0 on success, -1 when there is no such byte or on failure
+ */
+int storage_seek(size_t record, size_t offset, storage_reply_t *reply);
+
+/**
+ * Opens a reply on records [@param first, @param first + @param count),
+ * counting from the oldest record kept, clipped to the records there are.
+ * Only the bytes of those records are read.
+ * @return 0 on success, -1 on failure
+ */
+int storage_open_range(size_t first, size_t count, storage_reply_t *reply);
+
+/**
+ * Opens a reply on the last @param count records, or all of them when there
+ * are fewer.
+ * @return 0 on success, -1 on failure
+ */
+int storage_open_tail(size_t count, storage_reply_t *reply);
+
+/**
+ * Opens a reply on the records newer than sequence number @param seq, all of
+ * them when older ones were evicted since. Records are numbered from 1 as
+ * they are stored, counting those loaded from the backend at startup, so the
+ * numbers only carry over restarts when the backend keeps its history.
+ * @param head set to the sequence number of the last record in the reply,
+ * or of the newest one when the reply is empty
+ * @return 0 on success, -1 on failure
+ */
+int storage_open_since(uint64_t seq, storage_reply_t *reply, uint64_t *head);
+
+void storage_close_reply(storage_reply_t *reply);
+
+/**
+ * @return nonzero while @param reply holds an opened reply
+ */
+int storage_reply_open(storage_reply_t *reply);
+
+/**
+ * @return nonzero when @param reply is served from memory, the history cache
+ * or the mapped data file
+ */
+int storage_reply_cached(storage_reply_t *reply);
+
+/**
+ * Describes the rest of an in-memory reply as up to @param max iovecs
+ * pointing into the shared snapshot or the mapping, without consuming it.
+ * @return number of iovecs filled
+ */
+int storage_reply_iov(storage_reply_t *reply, struct iovec *iov, int max);
+
+/**
+ * Drops @param len bytes described by storage_reply_iov() from an in-memory reply.
+ */
+void storage_reply_consume(storage_reply_t *reply, size_t len);
+
+/**
+ * Reads the next chunk of the reply. Doesn't take the writer lock.
+ * @return bytes read, 0 once the snapshot is exhausted, or -1 on failure
+ */
+ssize_t storage_read(storage_reply_t *reply, char *buf, size_t len);
+
+/**
+ * Moves the next chunk of the reply to @param sockfd without copying it
+ * through user space: sendfile() for the data file, splice() through
+ * @param pipefd for the char device. @param pipe_len tracks bytes parked in
+ * the pipe between calls. Doesn't take the writer lock.
+ * @return bytes sent, 0 once the reply is complete, or -1 with errno set.
+ * EINVAL/ENOSYS before anything was sent means the kernel refuses zero-copy
+ * for this descriptor and the caller should use storage_read() instead.
+ */
+ssize_t storage_transfer(storage_reply_t *reply, int sockfd, int pipefd[2], size_t *pipe_len);
+
+#endif /* AESDSOCKET_STORAGE_H */
@@ -0,0 +1,124 @@
+#include "aesdsocket.h"
+#include "timestamp.h"
+#include "storage.h"
+#include <poll.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+
+static struct {
+    pthread_t thread_id;
+    int fd;
+} timer = { .fd = -1 };
+
+/* Date and zone of the last record, reformatted when the day or the UTC offset changes */
+static struct {
+    int year;
+    int yday;
+    long gmtoff;        /* changes on DST transitions within the day */
+    char date[48];      /* "timestamp:%a, %d %b %Y " */
+    char zone[8];       /* " %z\n" */
+} cache = { .year = -1 };
+
+size_t timestamp_format(time_t now, char *record, size_t size) {
+    struct tm tm_info;
+    int len;
+
+    if (!localtime_r(&now, &tm_info)) {
+        return 0;
+    }
+
+    if (tm_info.tm_year != cache.year || tm_info.tm_yday != cache.yday || tm_info.tm_gmtoff != cache.gmtoff) {
+        if (strftime(cache.date, sizeof(cache.date), "timestamp:%a, %d %b %Y ", &tm_info) == 0 ||
+            strftime(cache.zone, sizeof(cache.zone), " %z\n", &tm_info) == 0) {
+            cache.year = -1;
+            return 0;
+        }
+        cache.year = tm_info.tm_year;
+        cache.yday = tm_info.tm_yday;
+        cache.gmtoff = tm_info.tm_gmtoff;
+    }
+
+    len = snprintf(record, size, "%s%02d:%02d:%02d%s", cache.date,
+                   tm_info.tm_hour, tm_info.tm_min, tm_info.tm_sec, cache.zone);
+    if (len < 0 || (size_t)len >= size) {
+        return 0;
+    }
+
+    return len;
+}
+
+static void* timestamp_run(void *arg) {
+    char record[TIMESTAMP_RECORD_SIZE];
+    struct pollfd pfds[2];
+    uint64_t expirations;
+    size_t len;
+
+    pfds[0].fd = timer.fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = shutdown_fd;
+    pfds[1].events = POLLIN;
+
+    while (!close_server) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "timestamp poll failed: %s", strerror(errno));
+            break;
+        }
+        if (pfds[1].revents) {
+            break;
+        }
+
+        // Missed expirations are folded into one record, there's no point in repeating the same time
+        if (read(timer.fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            continue;
+        }
+
+        len = timestamp_format(time(NULL), record, sizeof(record));
+        if (len == 0 || storage_append(record, len) != 0) {
+            syslog(LOG_ERR, "couldnt write timestamp");
+        }
+    }
+
+    return NULL;
+}
+
+int timestamp_start(int interval) {
+    struct itimerspec spec;
+
+    timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer.fd == -1) {
+        syslog(LOG_ERR, "couldnt create timerfd: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = interval;
+    spec.it_interval.tv_sec = interval;
+    if (timerfd_settime(timer.fd, 0, &spec, NULL) == -1) {
+        syslog(LOG_ERR, "couldnt set timer: %s", strerror(errno));
+        close(timer.fd);
+        timer.fd = -1;
+        return -1;
+    }
+
+    if (spawn_worker(&timer.thread_id, timestamp_run, NULL) != 0) {
+        syslog(LOG_ERR, "couldnt create timestamp thread");
+        close(timer.fd);
+        timer.fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void timestamp_stop(void) {
+    if (timer.fd == -1) {
+        return;
+    }
+
+    pthread_join(timer.thread_id, NULL);
+    close(timer.fd);
+    timer.fd = -1;
+}
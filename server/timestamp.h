@@ -0,0 +1,26 @@
+#ifndef AESDSOCKET_TIMESTAMP_H
+#define AESDSOCKET_TIMESTAMP_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define DEFAULT_TIMESTAMP_INTERVAL 10
+#define TIMESTAMP_RECORD_SIZE 80
+
+/**
+ * Formats the "timestamp:<RFC 2822 time>\n" record for @param now into
+ * @param record. Only the time of day is formatted on each call, the date and
+ * zone part is cached until the day changes.
+ * @return length of the record, 0 on failure
+ */
+size_t timestamp_format(time_t now, char *record, size_t size);
+
+/**
+ * Appends a timestamp record to the storage every @param interval seconds from
+ * a thread driven by a timerfd, until close_server is set.
+ * @return 0 on success, -1 on failure
+ */
+int timestamp_start(int interval);
+void timestamp_stop(void);
+
+#endif /* AESDSOCKET_TIMESTAMP_H */
@@ -0,0 +1,523 @@
+#include "aesdsocket.h"
+#include "connection.h"
+#include "storage.h"
+#include "uring.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Operation tag kept in the low bits of user_data, next to the connection pointer */
+#define OP_ACCEPT   1
+#define OP_RECV     2
+#define OP_SEND     3
+#define OP_SHUTDOWN 4
+#define OP_TIMEOUT  5
+#define OP_MASK     7
+
+typedef struct uring_conn {
+    connection_t *conn;
+    int pending;            /* submitted operations without a completion yet */
+    int receiving;
+    int sending;
+    int failed;
+    struct iovec iov[OUT_MAX_IOV];  /* referenced by the sendmsg in flight */
+    struct msghdr msg;
+    LIST_ENTRY(uring_conn) entries;
+} uring_conn_t;
+
+typedef struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *buf_ring;
+    char *buf_base;
+    size_t buf_ring_size;
+    struct __kernel_timespec sweep_ts;
+    LIST_HEAD(uring_conn_list, uring_conn) conns;
+} uring_t;
+
+static int uring_setup(uring_t *ring) {
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd == -1) {
+        syslog(LOG_ERR, "io_uring_setup failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        syslog(LOG_ERR, "io_uring too old, needs IORING_FEAT_SINGLE_MMAP");
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring->ring_size) {
+        ring->ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        syslog(LOG_ERR, "couldnt map io_uring rings");
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        syslog(LOG_ERR, "couldnt map io_uring sqes");
+        munmap(ring->ring_ptr, ring->ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->ring_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->ring_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->ring_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->ring_ptr + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)((char *)ring->ring_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->ring_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->ring_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->ring_ptr + params.cq_off.cqes);
+
+    return 0;
+}
+
+static void uring_recycle_buffer(uring_t *ring, unsigned short bid) {
+    unsigned short tail = ring->buf_ring->tail;
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[tail & (URING_RECV_BUFFERS - 1)];
+
+    buf->addr = (unsigned long)(ring->buf_base + (size_t)bid * URING_RECV_BUFFER_SIZE);
+    buf->len = URING_RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&ring->buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_setup_buffers(uring_t *ring) {
+    struct io_uring_buf_reg reg;
+    unsigned short i;
+
+    ring->buf_ring_size = URING_RECV_BUFFERS * sizeof(struct io_uring_buf) +
+                          (size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE;
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        syslog(LOG_ERR, "couldnt allocate provided buffers");
+        return -1;
+    }
+    ring->buf_base = (char *)ring->buf_ring + URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->buf_ring;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        syslog(LOG_ERR, "couldnt register provided buffer ring: %s", strerror(errno));
+        munmap(ring->buf_ring, ring->buf_ring_size);
+        return -1;
+    }
+
+    ring->buf_ring->tail = 0;
+    for (i = 0; i < URING_RECV_BUFFERS; i++) {
+        uring_recycle_buffer(ring, i);
+    }
+
+    return 0;
+}
+
+static void uring_teardown(uring_t *ring) {
+    munmap(ring->buf_ring, ring->buf_ring_size);
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+}
+
+static unsigned uring_sq_space(uring_t *ring) {
+    return ring->sq_entries - (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static int uring_submit(uring_t *ring, unsigned wait_nr) {
+    unsigned to_submit = ring->sq_local_tail - *ring->sq_tail;
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                  wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret == -1 && errno != EINTR && errno != EBUSY) {
+        syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+    }
+    return ret;
+}
+
+static struct io_uring_sqe* uring_get_sqe(uring_t *ring) {
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (uring_sq_space(ring) == 0) {
+        uring_submit(ring, 0);
+        if (uring_sq_space(ring) == 0) {
+            return NULL;
+        }
+    }
+
+    index = ring->sq_local_tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static int uring_queue_accept(uring_t *ring, int sockfd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = OP_ACCEPT;
+    return 0;
+}
+
+static int uring_queue_shutdown_poll(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shutdown_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = OP_SHUTDOWN;
+    return 0;
+}
+
+static int uring_queue_recv(uring_t *ring, uring_conn_t *uc) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uc->conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uintptr_t)uc | OP_RECV;
+    uc->pending++;
+    return 0;
+}
+
+/**
+ * Sends the head of the connection's output queue with one sendmsg covering
+ * as many queued buffers as fit in OUT_MAX_IOV.
+ * @return 0 when a send was queued or there was nothing to send, -1 on failure
+ */
+static int uring_queue_send(uring_t *ring, uring_conn_t *uc) {
+    struct io_uring_sqe *sqe;
+    int iovcnt;
+
+    iovcnt = conn_out_iov(uc->conn, uc->iov, OUT_MAX_IOV);
+    if (iovcnt == 0) {
+        return 0;
+    }
+
+    sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+
+    memset(&uc->msg, 0, sizeof(uc->msg));
+    uc->msg.msg_iov = uc->iov;
+    uc->msg.msg_iovlen = iovcnt;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = uc->conn->fd;
+    sqe->addr = (unsigned long)&uc->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)uc | OP_SEND;
+    uc->pending++;
+    uc->sending = 1;
+    return 0;
+}
+
+static int uring_queue_sweep(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+
+    ring->sweep_ts.tv_sec = URING_SWEEP_SEC;
+    ring->sweep_ts.tv_nsec = 0;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&ring->sweep_ts;
+    sqe->len = 1;
+    sqe->user_data = OP_TIMEOUT;
+    return 0;
+}
+
+static void uring_conn_close(uring_conn_t *uc) {
+    LIST_REMOVE(uc, entries);
+    conn_destroy(uc->conn);
+    free(uc);
+}
+
+/**
+ * Frees a failed connection once nothing is in flight anymore, shutting the
+ * socket down first so operations that wait on the client complete.
+ */
+static void uring_conn_finish(uring_conn_t *uc) {
+    if (!uc->failed) {
+        return;
+    }
+    if (uc->pending == 0) {
+        uring_conn_close(uc);
+    } else {
+        shutdown(uc->conn->fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * Queues the operations the connection state machine asks for: a send while
+ * output is queued and a recv while it wants input. Both may be in flight.
+ * @return 0 when an operation is in flight, -1 when the connection is done
+ */
+static int uring_advance(uring_t *ring, uring_conn_t *uc) {
+    connection_t *conn = uc->conn;
+
+    if (uc->failed || conn->state == CONN_CLOSED) {
+        return -1;
+    }
+
+    if (!uc->sending && uring_queue_send(ring, uc) != 0) {
+        return -1;
+    }
+    if (!uc->receiving && conn_wants_input(conn)) {
+        if (uring_queue_recv(ring, uc) != 0) {
+            return -1;
+        }
+        uc->receiving = 1;
+    }
+
+    // Nothing left to send and no more input coming
+    if (uc->pending == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Disconnects the clients that haven't read any of their queued output within
+ * drain_timeout. Shutting the socket down fails the operations in flight, and
+ * the connection is freed with the last of them.
+ */
+static void uring_sweep(uring_t *ring) {
+    uring_conn_t *uc;
+    time_t now = conn_now();
+
+    LIST_FOREACH(uc, &ring->conns, entries) {
+        if (!uc->failed && conn_out_expired(uc->conn, now)) {
+            syslog(LOG_INFO, "Client %s stopped reading, disconnecting", uc->conn->addr);
+            uc->failed = 1;
+            shutdown(uc->conn->fd, SHUT_RDWR);
+        }
+    }
+}
+
+static void uring_handle_accept(uring_t *ring, int sockfd, struct io_uring_cqe *cqe) {
+    struct sockaddr_storage conn_addr;
+    socklen_t conn_len = sizeof(conn_addr);
+    uring_conn_t *uc;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // The multishot accept was terminated, arm a new one
+        uring_queue_accept(ring, sockfd);
+    }
+
+    if (cqe->res < 0) {
+        syslog(LOG_ERR, "couldnt accept conn: %s", strerror(-cqe->res));
+        return;
+    }
+
+    memset(&conn_addr, 0, sizeof(conn_addr));
+    getpeername(cqe->res, (struct sockaddr *)&conn_addr, &conn_len);
+
+    uc = calloc(1, sizeof(uring_conn_t));
+    if (!uc) {
+        close(cqe->res);
+        return;
+    }
+    uc->conn = conn_create(cqe->res, (struct sockaddr *)&conn_addr);
+    if (!uc->conn) {
+        close(cqe->res);
+        free(uc);
+        return;
+    }
+    LIST_INSERT_HEAD(&ring->conns, uc, entries);
+
+    if (uring_advance(ring, uc) != 0) {
+        uring_conn_close(uc);
+    }
+}
+
+static void uring_handle_recv(uring_t *ring, uring_conn_t *uc, struct io_uring_cqe *cqe) {
+    unsigned short bid;
+
+    uc->pending--;
+    uc->receiving = 0;
+
+    if (cqe->res == -ENOBUFS) {
+        // Every provided buffer is in use, try again once some are recycled
+        if (uring_advance(ring, uc) != 0) {
+            uc->failed = 1;
+        }
+    } else if (cqe->res < 0) {
+        uc->failed = 1;
+    } else {
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            conn_feed(uc->conn, ring->buf_base + (size_t)bid * URING_RECV_BUFFER_SIZE, cqe->res);
+            uring_recycle_buffer(ring, bid);
+        } else {
+            conn_feed(uc->conn, NULL, 0);
+        }
+
+        if (uring_advance(ring, uc) != 0) {
+            uc->failed = 1;
+        }
+    }
+
+    uring_conn_finish(uc);
+}
+
+static void uring_handle_send(uring_t *ring, uring_conn_t *uc, struct io_uring_cqe *cqe) {
+    uc->pending--;
+    uc->sending = 0;
+
+    if (cqe->res < 0) {
+        uc->failed = 1;
+    } else if (!uc->failed) {
+        conn_out_consume(uc->conn, cqe->res);
+        conn_resume(uc->conn);
+        if (uring_advance(ring, uc) != 0) {
+            uc->failed = 1;
+        }
+    }
+
+    uring_conn_finish(uc);
+}
+
+int run_uring(int sockfd) {
+    uring_t ring;
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    uintptr_t data;
+    int stop = 0;
+
+    memset(&ring, 0, sizeof(ring));
+    LIST_INIT(&ring.conns);
+
+    if (uring_setup(&ring) != 0) {
+        return -1;
+    }
+    if (uring_setup_buffers(&ring) != 0) {
+        munmap(ring.sqes, ring.sqes_size);
+        munmap(ring.ring_ptr, ring.ring_size);
+        close(ring.fd);
+        return -1;
+    }
+
+    if (uring_queue_accept(&ring, sockfd) != 0 || uring_queue_shutdown_poll(&ring) != 0 ||
+        uring_queue_sweep(&ring) != 0) {
+        uring_teardown(&ring);
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Serving connections with io_uring");
+
+    while (!stop && !close_server) {
+        if (uring_submit(&ring, 1) == -1 && errno != EINTR && errno != EBUSY) {
+            break;
+        }
+
+        head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            data = cqe->user_data;
+
+            switch (data & OP_MASK) {
+                case OP_ACCEPT:
+                    uring_handle_accept(&ring, sockfd, cqe);
+                    break;
+                case OP_RECV:
+                    uring_handle_recv(&ring, (uring_conn_t *)(data & ~(uintptr_t)OP_MASK), cqe);
+                    break;
+                case OP_SEND:
+                    uring_handle_send(&ring, (uring_conn_t *)(data & ~(uintptr_t)OP_MASK), cqe);
+                    break;
+                case OP_SHUTDOWN:
+                    stop = 1;
+                    break;
+                case OP_TIMEOUT:
+                    uring_sweep(&ring);
+                    uring_queue_sweep(&ring);
+                    break;
+                default:
+                    break;
+            }
+
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    // Closing the ring cancels everything still in flight
+    uring_teardown(&ring);
+
+    while (!LIST_EMPTY(&ring.conns)) {
+        uring_conn_close(LIST_FIRST(&ring.conns));
+    }
+
+    return 0;
+}
+
+#else
+
+int run_uring(int sockfd) {
+    syslog(LOG_ERR, "built without io_uring support");
+    return -1;
+}
+
+#endif
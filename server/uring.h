@@ -0,0 +1,18 @@
+#ifndef AESDSOCKET_URING_H
+#define AESDSOCKET_URING_H
+
+#define URING_ENTRIES 256
+#define URING_RECV_BUFFERS 64       /* must be a power of two */
+#define URING_RECV_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+#define URING_SWEEP_SEC 1           /* how often stalled connections are looked for */
+
+/**
+ * Serves the listening socket from a single io_uring: multishot accept,
+ * recv into a provided-buffer ring and the output queue sent with sendmsg.
+ * @return 0 once close_server is set, or -1 without serving anything when
+ * io_uring is not available so the caller can fall back to another mode.
+ */
+int run_uring(int sockfd);
+
+#endif /* AESDSOCKET_URING_H */